@@ -59,9 +59,21 @@
   v2.12, 10 July, 2013:
   * only write to the registry with an explicit -i;
   * read the options here, not from edit.
+
+  v2.13, 18 October, 2026:
+  + added -s to time the start-up, shown with the status;
+  * query the parent processes directly, only taking a snapshot of every
+    process if that fails;
+  * look for the DLL where it is loaded here, before taking a snapshot of the
+    parent's modules;
+  + added --auto for AutoRun, exiting straight away if the parent has /C or /R;
+  * find the parent and its status in edit's registry of instances, falling
+    back to the modules and exports for older versions;
+  + added -m to write the metrics of every instance (and have the primary
+    instance write them periodically).
 */
 
-#define PDATE L"10 July, 2013"
+#define PDATE L"18 October, 2026"
 
 #include "CMDread.h"
 #include "version.h"
@@ -76,6 +88,32 @@ int _CRT_glob = 0;
 #endif
 
 
+// PROCESS_BASIC_INFORMATION, as returned by NtQueryInformationProcess (the
+// status and priority are padded to pointer size).
+typedef struct
+{
+  LONG_PTR  ExitStatus;
+  PVOID     PebBaseAddress;
+  ULONG_PTR AffinityMask;
+  LONG_PTR  BasePriority;
+  ULONG_PTR UniqueProcessId;
+  ULONG_PTR InheritedFromUniqueProcessId;
+} ProcessBasicInfo;
+
+// UNICODE_STRING, for the parent's command line.
+typedef struct
+{
+  USHORT Length;
+  USHORT MaximumLength;
+  PWSTR  Buffer;
+} UnicodeStr;
+
+// Position of the process parameters in the PEB and of the command line in
+// the process parameters.
+#define PEB_PARAMS   (4 * sizeof(PVOID))
+#define PARAMS_CMD   (16 + 12 * sizeof(PVOID))
+
+
 #define CMDREAD L"Software\\Microsoft\\Command Processor"
 #define AUTORUN L"AutoRun"
 
@@ -89,10 +127,18 @@ int _CRT_glob = 0;
 
 
 void status( void );
+void show_timing( void );
 void help( void );
+void time_phase( int );
 
 BOOL  find_proc_id( HANDLE snap, DWORD id, LPPROCESSENTRY32, LPPROCESSENTRY32 );
+BOOL  query_info( HANDLE, ProcessBasicInfo* );
+DWORD query_parent( HANDLE );
+DWORD snap_parent( void );
+BOOL  parent_exiting( void );
 DWORD GetParentProcessId( void );
+BOOL  find_instance( DWORD id );
+int   find_module( DWORD id, PBYTE* base );
 BOOL  IsInstalled( DWORD id, PBYTE* base );
 void  GetStatus( DWORD id, PBYTE base );
 void  Inject( HANDLE hProcess );
@@ -107,6 +153,14 @@ __declspec(dllimport) WCHAR  cfgname[MAX_PATH];
 __declspec(dllimport) WCHAR  hstname[MAX_PATH];
 __declspec(dllimport) BOOL   cmd_history;
 __declspec(dllimport) Status local;
+__declspec(dllimport) Timing start_timing;
+__declspec(dllimport) BOOL   copy_instance( int, PInstance );
+__declspec(dllimport) WCHAR  mtrname[MAX_PATH];
+__declspec(dllimport) DWORD  mtr_secs;
+__declspec(dllimport) BOOL   write_metrics( PCWSTR );
+
+Timing	 timing;			// our part of the start-up
+LONGLONG time_last;			// when the current phase started
 
 
 #if defined(__MINGW32__) && !defined(__MINGW64_VERSION_MAJOR)
@@ -135,6 +189,7 @@ int wmain( int argc, wchar_t* argv[] )
   LPWSTR ops;
   char	 state;
   LPWSTR hname;
+  LPWSTR mname;
   ULONG  num;
   HKEY	 key, root;
   DWORD  exist;
@@ -145,6 +200,16 @@ int wmain( int argc, wchar_t* argv[] )
   LPWSTR cmdpos;
   char	 cp[16];
 
+  // AutoRun uses this; do as little as possible for "cmd /c".
+  if (argc > 1 && wcscmp( argv[1], L"--auto" ) == 0)
+  {
+    if (parent_exiting())
+      return 0;
+    argv[1] = argv[0];
+    ++argv;
+    --argc;
+  }
+
   // Thanks to Michael Kaplan.
   // http://blogs.msdn.com/b/michkap/archive/2010/10/07/10072032.aspx
   // However, it seems the fputws in MSVCRT.DLL (Win7 HP 64-bit) doesn't work
@@ -171,13 +236,19 @@ int wmain( int argc, wchar_t* argv[] )
     }
   }
 
+  time_phase( -1 );
   pid = GetParentProcessId();
-  active = IsInstalled( pid, &base );
+  time_phase( TIME_PARENT );
+  base = NULL;
+  active = (find_instance( pid ) || IsInstalled( pid, &base ));
+  time_phase( TIME_INSTALLED );
   if (!ReadOptions( HKEY_CURRENT_USER, active ))
     ReadOptions( HKEY_LOCAL_MACHINE, active );
+  time_phase( TIME_OPTIONS );
   if (active)
   {
-    GetStatus( pid, base );
+    if (base != NULL)
+      GetStatus( pid, base );
     if (argc == 1)
     {
       status();
@@ -186,7 +257,7 @@ int wmain( int argc, wchar_t* argv[] )
   }
 
   update = FALSE;
-  hname = NULL;
+  hname = mname = NULL;
   root = HKEY_CURRENT_USER;
 
   for (j = 1; j < argc; ++j)
@@ -223,6 +294,7 @@ int wmain( int argc, wchar_t* argv[] )
 	  case 'g': opt = &option.silent;        break;
 	  case 'o': opt = &option.overwrite;     break;
 	  case 'r': opt = &option.auto_recall;   break;
+	  case 's': opt = &option.timing;        break;
 	  case 't': opt = &option.disable_macro; break;
 	  case '_': opt = &option.underscore;    break;
 
@@ -431,6 +503,11 @@ int wmain( int argc, wchar_t* argv[] )
 	    cmd_history = TRUE;
 	  break;
 
+	  case 'm':
+	    mname = arg + 1;
+	    end = wcschr( arg + 1, '\0' );
+	  break;
+
 	  default:
 	    wprintf( L"CMDread: invalid option: '%c'.\n", *arg );
 	  return 1;
@@ -469,6 +546,34 @@ int wmain( int argc, wchar_t* argv[] )
   }
   if (hname || !active)
     wcscpy( hstname, local.hstname );
+  if (mname)
+  {
+    end = wcsrchr( mname, ',' );
+    if (end != NULL)
+    {
+      *end++ = '\0';
+      mtr_secs = wcstoul( end, NULL, 10 );
+    }
+    if (*mname)
+      GetFullPathName( mname, lenof(mtrname), mtrname, NULL );
+    if (!*mtrname)
+    {
+      _putws( L"CMDread: no metrics file has been given." );
+      return 1;
+    }
+    if (!write_metrics( mtrname ))
+    {
+      wprintf( L"CMDread: unable to write \"%s\".\n", mtrname );
+      return 1;
+    }
+    // Let the primary instance change its timer now.
+    ph = OpenEvent( EVENT_MODIFY_STATE, FALSE, METRICS_EVENT );
+    if (ph != NULL)
+    {
+      SetEvent( ph );
+      CloseHandle( ph );
+    }
+  }
   if (!active && !*cfgname)
     wcscpy( cfgname, cmdname );
 
@@ -497,8 +602,17 @@ int wmain( int argc, wchar_t* argv[] )
       _putws( L"CMDread: could not open parent process." );
       return 1;
     }
+    time_phase( -1 );
     Inject( ph );
+    time_phase( TIME_INJECT );
     CloseHandle( ph );
+
+    // Leave our timing for the DLL to pick up when it's ready.
+    if (option.timing)
+    {
+      timing.pid = pid;
+      start_timing = timing;
+    }
   }
 
   return 0;
@@ -611,6 +725,55 @@ void status( void )
 	   name,
 	   (local.enabled) ? L"en" : L"dis"
 	 );
+
+  if (*mtrname)
+  {
+    if (mtr_secs)
+      wprintf( L"* Metrics file: \"%s\", every %lu seconds.\n",
+	       mtrname, mtr_secs );
+    else
+      wprintf( L"* Metrics file: \"%s\".\n", mtrname );
+  }
+
+  if (option.timing)
+    show_timing();
+}
+
+
+// Display how long each phase of the start-up took.
+void show_timing( void )
+{
+  static const LPCWSTR phase[TIME_PHASES] =
+  {
+    L"find parent", L"check installed", L"read options", L"inject",
+    L"hook", L"history", L"configuration",
+  };
+  int j;
+
+  if (!local.timing.ready)
+  {
+    _putws( L"* Start-up timing will be shown for new instances." );
+    return;
+  }
+
+  wprintf( L"* Start-up took %.1f ms from CMD.EXE starting:\n",
+	   local.timing.ready / 1e4 );
+  for (j = 0; j < TIME_PHASES; ++j)
+    wprintf( L"    %-16s%9.3f ms\n", phase[j],
+	     local.timing.phase[j] * 1e3 / local.timing.freq );
+}
+
+
+// Add the time since the previous call to phase (or just start timing, if
+// phase is -1).
+void time_phase( int phase )
+{
+  LONGLONG now;
+
+  QueryPerformanceCounter( (PLARGE_INTEGER)&now );
+  if (phase >= 0)
+    timing.phase[phase] += now - time_last;
+  time_last = now;
 }
 
 
@@ -648,14 +811,109 @@ BOOL find_proc_id( HANDLE snap, DWORD id, LPPROCESSENTRY32 pe,
 }
 
 
-// Obtain the process identifier of the parent process; verify the architecture.
-DWORD GetParentProcessId( void )
+// Get the basic information of a process.
+BOOL query_info( HANDLE ph, ProcessBasicInfo* pbi )
+{
+  typedef LONG (WINAPI *LPFN_NTQUERYINFORMATIONPROCESS)( HANDLE, int, PVOID,
+							 ULONG, PULONG );
+  static LPFN_NTQUERYINFORMATIONPROCESS fnNtQueryInformationProcess;
+
+  if (fnNtQueryInformationProcess == NULL)
+  {
+    fnNtQueryInformationProcess = (LPFN_NTQUERYINFORMATIONPROCESS)
+	GetProcAddress( GetModuleHandle( L"ntdll.dll" ),
+			"NtQueryInformationProcess" );
+    if (fnNtQueryInformationProcess == NULL)
+      return FALSE;
+  }
+
+  // 0 is ProcessBasicInformation; anything but 0 returned is an error.
+  return (fnNtQueryInformationProcess( ph, 0, pbi, sizeof(*pbi), NULL ) == 0);
+}
+
+
+// Ask for the parent of a process directly.  Returns 0 if it can't be done.
+DWORD query_parent( HANDLE ph )
+{
+  ProcessBasicInfo pbi;
+
+  if (!query_info( ph, &pbi ))
+    return 0;
+
+  return (DWORD)pbi.InheritedFromUniqueProcessId;
+}
+
+
+// Determine if the parent is only running a command (its switches include /C
+// or /R, which also covers running a batch file), in which case there's no
+// point installing.  The command line is read from the parent's PEB.
+BOOL parent_exiting( void )
+{
+  HANDLE     ph;
+  ProcessBasicInfo pbi;
+  PBYTE      params;
+  UnicodeStr cmd;
+  WCHAR      buf[260];
+  LPWSTR     p, end;
+  BOOL	     quote, exiting;
+
+  ph = OpenProcess( PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE,
+		    query_parent( GetCurrentProcess() ) );
+  if (ph == NULL)
+    return FALSE;
+  cmd.Length = 0;
+  if (query_info( ph, &pbi ) &&
+      ReadProcessMemory( ph, (PBYTE)pbi.PebBaseAddress + PEB_PARAMS,
+			 &params, sizeof(params), NULL ) &&
+      ReadProcessMemory( ph, params + PARAMS_CMD, &cmd, sizeof(cmd), NULL ))
+  {
+    // The switches come first, so there's no need for all of it.
+    if (cmd.Length > sizeof(buf))
+      cmd.Length = sizeof(buf);
+    if (!ReadProcessMemory( ph, cmd.Buffer, buf, cmd.Length, NULL ))
+      cmd.Length = 0;
+  }
+  CloseHandle( ph );
+
+  // Skip the program name.
+  p = buf;
+  end = buf + cmd.Length / sizeof(WCHAR);
+  for (quote = FALSE; p < end && (quote || (*p != ' ' && *p != '\t')); ++p)
+    if (*p == '"')
+      quote = !quote;
+
+  exiting = FALSE;
+  while (p < end)
+  {
+    if (*p == ' ' || *p == '\t')
+    {
+      ++p;
+      continue;
+    }
+    // Anything but a switch is the command, so it's too late to find one.
+    if (*p != '/' || ++p == end)
+      break;
+    if (*p == 'c' || *p == 'C' || *p == 'r' || *p == 'R')
+    {
+      exiting = TRUE;
+      break;
+    }
+    if (*p == 'k' || *p == 'K')
+      break;
+    // Skip the switch (and its value), allowing for "/q/c".
+    while (p < end && *p != ' ' && *p != '\t' && *p != '/')
+      ++p;
+  }
+
+  return exiting;
+}
+
+
+// Find the parent and grandparent from a snapshot of every process.
+DWORD snap_parent( void )
 {
-  HANDLE hSnap, ph;
+  HANDLE hSnap;
   PROCESSENTRY32 pe, ppe;
-  BOOL	 parent_wow64, me_wow64;
-  typedef BOOL (WINAPI *LPFN_ISWOW64PROCESS)( HANDLE, PBOOL );
-  LPFN_ISWOW64PROCESS fnIsWow64Process;
 
   hSnap = CreateToolhelp32Snapshot( TH32CS_SNAPPROCESS, 0 );
   if (hSnap == INVALID_HANDLE_VALUE)
@@ -680,11 +938,45 @@ DWORD GetParentProcessId( void )
 
   CloseHandle( hSnap );
 
+  return pe.th32ProcessID;
+}
+
+
+// Obtain the process identifier of the parent process; verify the architecture.
+// The parent and grandparent are asked for directly, since a snapshot of every
+// process can be slow; the snapshot is only used if that fails.
+DWORD GetParentProcessId( void )
+{
+  HANDLE ph;
+  DWORD  pid;
+  BOOL	 parent_wow64, me_wow64;
+  typedef BOOL (WINAPI *LPFN_ISWOW64PROCESS)( HANDLE, PBOOL );
+  LPFN_ISWOW64PROCESS fnIsWow64Process;
+
+  ph  = NULL;
+  pid = query_parent( GetCurrentProcess() );
+  if (pid != 0)
+  {
+    ph = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, pid );
+    if (ph != NULL)
+    {
+      parent_pid = query_parent( ph );
+      if (parent_pid == 0)
+      {
+	CloseHandle( ph );
+	ph = NULL;
+      }
+    }
+  }
+  if (ph == NULL)
+    pid = snap_parent();
+
   fnIsWow64Process = (LPFN_ISWOW64PROCESS)GetProcAddress(
 			GetModuleHandle( L"kernel32.dll" ), "IsWow64Process" );
   if (fnIsWow64Process != NULL)
   {
-    ph = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, pe.th32ProcessID );
+    if (ph == NULL)
+      ph = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, pid );
     if (ph == NULL)
     {
       _putws( L"CMDread: could not open parent process." );
@@ -692,7 +984,6 @@ DWORD GetParentProcessId( void )
     }
     fnIsWow64Process( ph, &parent_wow64 );
     fnIsWow64Process( GetCurrentProcess(), &me_wow64 );
-    CloseHandle( ph );
 
     if (parent_wow64 != me_wow64)
     {
@@ -701,20 +992,118 @@ DWORD GetParentProcessId( void )
       exit( 1 );
     }
   }
+  if (ph != NULL)
+    CloseHandle( ph );
 
-  return pe.th32ProcessID;
+  return pid;
+}
+
+
+// Look for process id in the registry of instances, copying its status.  Only
+// instances of this DLL will be there; anything else needs IsInstalled and
+// GetStatus.
+BOOL find_instance( DWORD id )
+{
+  FILETIME created, dummy;
+  HANDLE   ph;
+  Instance inst;
+  BOOL	   ok;
+  int	   j;
+
+  // Make sure it's not an entry left by a terminated process with the same id.
+  ph = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, id );
+  if (ph == NULL)
+    return FALSE;
+  ok = GetProcessTimes( ph, &created, &dummy, &dummy, &dummy );
+  CloseHandle( ph );
+  if (!ok)
+    return FALSE;
+
+  for (j = 0; j < INSTANCES; ++j)
+  {
+    if (copy_instance( j, &inst ) && (DWORD)inst.pid == id &&
+	CompareFileTime( &inst.created, &created ) == 0)
+    {
+      local = inst.status;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
 }
 
 
-// Determine if CMDread is already installed in the parent.
+// Look for our DLL in process id at the address it has here (a DLL is usually
+// loaded at the same address in every process).  Returns TRUE if it's there,
+// FALSE if nothing is there, or -1 if it can't tell (something else is there,
+// so it may have been loaded elsewhere).
+int find_module( DWORD id, PBYTE* base )
+{
+  typedef DWORD (WINAPI *LPFN_GETMAPPEDFILENAME)( HANDLE, LPVOID, LPWSTR,
+						  DWORD );
+  LPFN_GETMAPPEDFILENAME fnGetMappedFileName;
+  MEMORY_BASIC_INFORMATION mbi;
+  HANDLE ph;
+  PBYTE  mod;
+  WCHAR  name[MAX_PATH];
+  LPWSTR file;
+  DWORD  len;
+  int	 found;
+
+  mod = (PBYTE)GetModuleHandle( EDITDLL );
+  fnGetMappedFileName = (LPFN_GETMAPPEDFILENAME)GetProcAddress(
+		GetModuleHandle( L"kernel32.dll" ), "K32GetMappedFileNameW" );
+  if (fnGetMappedFileName == NULL)
+  {
+    HMODULE psapi = LoadLibrary( L"psapi.dll" );
+    if (psapi != NULL)
+      fnGetMappedFileName = (LPFN_GETMAPPEDFILENAME)GetProcAddress( psapi,
+							"GetMappedFileNameW" );
+  }
+  if (mod == NULL || fnGetMappedFileName == NULL)
+    return -1;
+
+  ph = OpenProcess( PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, id );
+  if (ph == NULL)
+    return -1;
+
+  found = -1;
+  if (VirtualQueryEx( ph, mod, &mbi, sizeof(mbi) ) == sizeof(mbi))
+  {
+    if (mbi.State == MEM_FREE)
+      found = FALSE;
+    else if (mbi.Type == MEM_IMAGE && mbi.AllocationBase == mod)
+    {
+      len = fnGetMappedFileName( ph, mod, name, lenof(name) );
+      for (file = name + len; file > name && file[-1] != '\\'; --file) ;
+      if (len != 0 && _wcsicmp( file, EDITDLL ) == 0)
+      {
+	*base = mod;
+	found = TRUE;
+      }
+    }
+  }
+  CloseHandle( ph );
+
+  return found;
+}
+
+
+// Determine if CMDread is already installed in the parent.  Try where the DLL
+// is here first, only taking a snapshot of the modules if that can't tell.
 BOOL IsInstalled( DWORD id, PBYTE* base )
 {
   HANDLE hModuleSnap;
   MODULEENTRY32 me;
   BOOL	 fOk;
+  int	 found;
 
   *base = NULL;
 
+  found = find_module( id, base );
+  if (found != -1)
+    return found;
+
   // Take a snapshot of all modules in the current process.
   hModuleSnap = CreateToolhelp32Snapshot( TH32CS_SNAPMODULE, id );
 
@@ -855,9 +1244,9 @@ void help( void )
   L"Provide enhanced command line editing for CMD.EXE (32-bit).\n"
 #endif
   L"\n"
-  L"CMDread [-begkortz_] [-c[INS][,OVR]] [-h[HIST]] [-lLEN] [-pCHAR] [-qCHAR]\n"
+  L"CMDread [-begkorstz_] [-c[INS][,OVR]] [-h[HIST]] [-lLEN] [-pCHAR] [-qCHAR]\n"
   L"        [-kcCMD] [-kmSEL] [-krREC] [-kdDRV] [-ksSEP] [-kpDIR] [-kbBASE] [-kgGT]\n"
-  L"        [-f[HISTFILE]] [CFGFILE] [-iIuU]\n"
+  L"        [-f[HISTFILE]] [-m[FILE][,SECS]] [CFGFILE] [-iIuU]\n"
   L"\n"
   L"    -b\t\tdisable backslash appending for completed directories\n"
   L"    -c\t\tswap insert and overwrite cursors, or set their size\n"
@@ -867,10 +1256,12 @@ void help( void )
   L"    -h\t\tremember the last HIST commands (0 will remember everything)\n"
   L"    -k\t\tdisable colouring\n"
   L"    -l\t\tminimum line length to remember\n"
+  L"    -m\t\twrite the metrics of every instance to FILE (and every SECS)\n"
   L"    -o\t\tdefault overwrite mode\n"
   L"    -p\t\tuse CHAR to disable translation for the current line\n"
   L"    -q\t\tuse CHAR to update the line in the history\n"
   L"    -r\t\tdefault auto-recall mode\n"
+  L"    -s\t\trecord the start-up timing (shown with the status)\n"
   L"    -t\t\tdisable translation\n"
   L"    -z\t\tdisable CMDread\n"
   L"    -_\t\tunderscore is not part of a word\n"
@@ -892,7 +1283,7 @@ void help( void )
   _putws( // too big for a single statement?
   L"CMDread with no arguments will either install itself into the current CMD.EXE\n"
   L"or display the status of the already running instance.  When CMDread is already\n"
-  L"running, options -begkort_ will toggle the current state; prefix them with '+'\n"
+  L"running, options -begkorst_ will toggle the current state; prefix them with '+'\n"
   L"to explicitly turn on (set behaviour indicated above) or with '-' to turn off\n"
   L"(set default behaviour).  Eg: \"CMDread -+b-g\" will disable backslash appending\n"
   L"and enable the beep, irrespective of the current state.\n"
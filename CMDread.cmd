@@ -7,4 +7,6 @@
 @set "cmdline=%CMDCMDLINE:"=%"
 :: This relies on %ComSpec% not having spaces.
 @for /f "tokens=2" %%j in ("%cmdline%") do @set arg1=%%j
-@if /i "%arg1%" NEQ "/c" "%~dpn0_%PROCESSOR_ARCHITECTURE%.exe" %*
+:: That only catches the most common case; the exe itself checks for the rest
+:: (such as "/q /c" or "/r") before doing anything else.
+@if /i "%arg1%" NEQ "/c" "%~dpn0_%PROCESSOR_ARCHITECTURE%.exe" --auto %*
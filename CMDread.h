@@ -58,15 +58,82 @@ typedef struct
   char	underscore;		// is underscore part of a word?
   WCHAR ignore_char;		// prefix character to disable translation
   WCHAR update_char;		// prefix character to update history line
+  char	timing; 		// record the start-up timing
 } Option;
 
 
+// Phases of start-up, the first few in CMDread, the rest in the edit DLL.
+enum
+{
+  TIME_PARENT,			// find the parent process
+  TIME_INSTALLED,		// see if it's already installed
+  TIME_OPTIONS, 		// read the options
+  TIME_INJECT,			// load the DLL into CMD.EXE
+  TIME_HOOK,			// hook the console functions
+  TIME_HISTORY, 		// read or copy the history
+  TIME_CONFIG,			// read the configuration file
+  TIME_PHASES
+};
+
 typedef struct
 {
-  int	version;
-  char	enabled;		// is this instance active?
-  WCHAR hstname[MAX_PATH];	// the history file
+  DWORD    pid; 		// process being started
+  LONGLONG freq;		// performance counter frequency
+  LONGLONG phase[TIME_PHASES];	// counts spent in each phase
+  LONGLONG ready;		// 100ns units from CMD.EXE to the first line
+} Timing;
+
+
+typedef struct
+{
+  int	 version;
+  char	 enabled;		// is this instance active?
+  WCHAR  hstname[MAX_PATH];	// the history file
+  Timing timing;		// how long it took to start
 } Status;
 
 
+// Counters exported as metrics (see metric_str in edit.c for their names).
+typedef struct
+{
+  LONGLONG lines;		// lines read
+  LONGLONG keys;		// keys read
+  LONGLONG con_calls;		// console output functions used to edit
+  LONGLONG con_chars;		// characters written or filled by them
+  LONGLONG completions; 	// file name completions
+  LONGLONG completion_us;	// microseconds taken by them
+  LONGLONG hist_lines;		// lines in the history
+  LONGLONG hist_bytes;		// memory used by them
+  LONGLONG macros;		// keyboard and command macros
+  LONGLONG symbols;
+  LONGLONG assocs;
+} Metrics;
+
+#define METRICS (sizeof(Metrics) / sizeof(LONGLONG))
+
+// Event set by CMDread -m to have the primary instance restart its timer.
+#ifdef _WIN64
+#define METRICS_EVENT L"CMDread metrics (64-bit)"
+#else
+#define METRICS_EVENT L"CMDread metrics (32-bit)"
+#endif
+
+
+// Registry of running instances, so CMDread can find one without taking a
+// snapshot of the modules and reading the status from the DLL's exports.
+// Claiming an entry is lock-free; its contents are guarded by a sequence
+// number, odd while the owner is writing them, so a reader can tell that its
+// copy is consistent (see copy_instance).
+#define INSTANCES 32
+
+typedef struct
+{
+  LONG	   pid; 		// process using this entry (0 if free)
+  LONG	   seq; 		// bumped before and after writing the rest
+  FILETIME created;		// when it was created (the id could be reused)
+  Status   status;		// copy of its status
+  Metrics  metrics;		// and its counters
+} Instance, *PInstance;
+
+
 #define REGKEY L"Software\\Adoxa\\CMDkey"
@@ -92,6 +92,35 @@
   v2.12, 10 July, 2013:
   * read options from CMDread, not here;
   - fix saving to the history file specified from the command line.
+
+  v2.13, 18 October, 2026:
+  * find file names on another thread, so a key press can cancel completion;
+  * store completed file names together, rather than as history lines;
+  + complete arguments from the history when there's no matching file;
+  + give up on completion if a path takes too long and remember it for a bit;
+  + wildcards in directories (and "**" for any subdirectory) in completion;
+  * hash macros, symbols and associations; list them in order of definition;
+  * index each extension of the associations;
+  * compile macro lines and find the arguments once per macro;
+  * only expand a definition once per line (no more endless recursion);
+  * remember the expansions of recent lines (not those from a macro);
+  * expand braces away from the line, writing the result once;
+  * look up environment variables in a snapshot of the environment;
+  * flag the quotes of the line once, rather than for every check;
+  * remove escapes and quotes in one pass, rather than one at a time;
+  + cache the state made by the configuration file;
+  * index the directory sections of the configuration file in the cache;
+  + time the start-up (hooking, history and configuration);
+  * read the history and configuration files in the background;
+  * only query the cursor for the newline before the prompt when it's needed
+    (when removing the prompt), not for every newline written;
+  + keep a registry of the running instances (and their status) in the shared
+    section;
+  + added lstt to list how long the functions, completion, history searches
+    and expansion take;
+  + write the counters of every instance to a metrics file, on request or
+    periodically by the primary instance;
+  + lstt shows the median and 99th percentile, and the console writes per key.
 */
 
 #include "CMDread.h"
@@ -166,8 +195,16 @@ SHARED Option option = {
   1,				// underscore is part of a word
   ' ',                          // prefix character to disable translation
   '+',                          // prefix character to update history line
+  0,				// don't time the start-up
 };
 
+SHARED Timing start_timing = { 0 };	// CMDread's part of the start-up
+
+SHARED Instance instances[INSTANCES] = { { 0 } }; // the running instances
+
+SHARED WCHAR mtrname[MAX_PATH] = { 0 }; // metrics file
+SHARED DWORD mtr_secs = 0;		// seconds between writing it (0 = never)
+
 SHARED WCHAR cfgname[MAX_PATH] = { 0 }; // configuration file
 SHARED WCHAR hstname[MAX_PATH] = { 0 }; // history file
 SHARED BOOL  cmd_history = FALSE;	// read command line history file
@@ -217,43 +254,185 @@ typedef struct macro_s
 } Macro, *PMacro;
 
 
+// Structure for a piece of a macro line: literal text or an argument.
+typedef struct
+{
+  DWORD pos, len;			// literal text within the line
+  int	arg;				// argument number, or -1 for literal text
+  BOOL	rest;				// include all the following arguments
+} MacroPart;
+
+
+// Structure for a compiled macro line.
+typedef struct
+{
+  DWORD     parts;			// number of pieces
+  MacroPart part[0];
+} MacroTmpl, *PMacroTmpl;
+
+
 // Structure to hold lines for macros, symbols and associations.
 typedef struct linelist_s
 {
   struct linelist_s* next;
+  PMacroTmpl tmpl;			// compiled macro line (once it's used)
   DWORD  len;
   WCHAR  line[0];
 } LineList, *PLineList;
 
 
+#define MACRO_ARGS 10			// %0 to %9
+
+// Structure for an executing macro, remembering the line that invoked it.
+typedef struct call_s
+{
+  struct call_s* next;			// macro that invoked this one
+  struct define_s* def; 		// the macro itself
+  PLineList line;			// next line to execute
+  DWORD     arg[MACRO_ARGS];		// position of each argument
+  DWORD     cnt[MACRO_ARGS];		// length of each argument
+  DWORD     end;			// end of the arguments
+  DWORD     len;			// length of the invoking line
+  WCHAR     txt[0];			// the invoking line
+} MacroCall, *PMacroCall;
+
+
+// Structure to remember the expansion of a line.
+typedef struct memo_s
+{
+  struct memo_s* next;			// most recently used first
+  struct memo_s* prev;
+  DWORD  gen;				// generation of the definitions
+  WCHAR  ign;				// ignore character at the time
+  DWORD  hash;				// hash of the input
+  DWORD  inlen, outlen; 		// length of the input and output
+  WCHAR  txt[0];			// input followed by output
+} Memo, *PMemo;
+
+#define MEMO_LINES 16			// number of expansions remembered
+#define EXPANSIONS 32			// most definitions expanded in a line
+
+
+// Structure for a variable in the snapshot of the environment.
+typedef struct envent_s
+{
+  struct envent_s* chain;		// next with the same hash
+  PCWSTR name, val;			// name and value within the snapshot
+  DWORD  namelen, vallen;		// length of above
+  DWORD  hash;				// hash of the name
+} EnvEnt, *PEnvEnt;
+
+
 // Structure for a definition (macro, symbol or association).
 typedef struct define_s
 {
-  struct define_s* next;
+  struct define_s* next;		// next defined (or lower on the stack)
+  struct define_s* prev;		// previously defined
+  struct define_s* chain;		// next with the same hash
   PLineList line;
+  DWORD     hash;
   DWORD     len;
   WCHAR     name[0];
 } Define, *PDefine;
 
 
-// Structure for the history and completed filenames.
+// Structure for a set of definitions, hashed by name (ignoring case) and kept
+// in the order they were defined.
+typedef struct
+{
+  PDefine* hash;			// the buckets
+  DWORD    size;			// number of buckets (a power of two)
+  DWORD    count;			// number of definitions
+  PDefine  head, tail;			// first and last defined
+} Dict, *PDict;
+
+#define DICT_SIZE 64			// initial number of buckets
+
+
+// Structure for one extension of a list (such as an association's name).
+typedef struct ext_s
+{
+  struct ext_s* chain;			// next with the same hash
+  PDefine def;				// association it belongs to (if any)
+  PCWSTR  ext;				// the extension, within its list
+  DWORD   hash;
+  DWORD   len;
+} Ext, *PExt;
+
+
+// Structure for an index of extensions, hashed ignoring case.
+typedef struct
+{
+  PExt* hash;				// the buckets
+  DWORD size;				// number of buckets (a power of two)
+  DWORD count;				// number of extensions
+} ExtMap, *PExtMap;
+
+
+// Structure for the history.
 typedef struct history_s
 {
   struct history_s* prev;
   struct history_s* next;
-  union
-  {
-    DWORD  len; 		// history line length
-    struct
-    {
-      WORD flen;		// file name length
-      WORD dlen;		// displayed length
-    };
-  };
+  DWORD  len;			// history line length
   WCHAR  line[0];
 } History, *PHistory;
 
 
+// Structure for the latency of something, with a histogram of powers of two.
+#define LAT_BUCKETS 24			// the last is 2^22 us (4s) or more
+
+typedef struct
+{
+  DWORD    count;			// number of times
+  DWORD    bucket[LAT_BUCKETS]; 	// bucket n is less than 2^n us
+  LONGLONG total;			// total counts of all of them
+} Latency;
+
+
+// Structure for the history token index, a trie of the arguments used in the
+// history (ignoring case), with the number of times each one is used.
+typedef struct token_s
+{
+  struct token_s* child;	// first token continuing this one
+  struct token_s* next; 	// next token at this position (sorted)
+  PWSTR  txt;			// the token as first used (if uses)
+  DWORD  uses;			// number of times it's in the history
+  WORD	 len;			// length of txt
+  WCHAR  ch;			// lower case character at this position
+} Token, *PToken;
+
+
+// Structure for a completed filename, with its text in the name pool.
+typedef struct
+{
+  DWORD  ofs;			// position of the name in the pool
+  WORD	 flen;			// file name length
+  WORD	 dlen;			// displayed length
+  DWORD  attrs; 		// file attributes
+} FName, *PFName;
+
+
+// Header of the configuration cache.  It's followed by the history lines the
+// configuration added, then the keymaps, keyboard macros, macros, symbols and
+// associations, as they were when the first directory section was reached,
+// the index of the directory sections, then by the hash of all that.
+typedef struct
+{
+  DWORD    magic;		// CACHE_MAGIC
+  DWORD    version;		// PVERX
+  DWORD    options;		// hash of the options
+  DWORD    size;		// size of the configuration file
+  FILETIME time;		// its last write time
+  DWORD    hash;		// hash of its contents
+  DWORD    sect;		// position of the first directory section
+  DWORD    sect_line;		// its line number (0 if there isn't one)
+} CacheHdr;
+
+#define CACHE_MAGIC 0x64444D43	// "CMDd"
+#define CACHE_EXT   L".cache"   // appended to the configuration file name
+
+
 // Function prototype for an internal command.
 typedef void (*IntFunc)( DWORD );
 
@@ -284,9 +463,16 @@ Status	local = {
 };
 
 static DWORD conwr;		// dummy variable for API functions
-#define WriteCon( h, t, l )	  WriteConsole( h, t, l, &conwr, NULL )
-#define FillConChar( h, c, l, p ) FillConsoleOutputCharacter( h,c,l,p,&conwr )
-#define FillConAttr( h, a, l, p ) FillConsoleOutputAttribute( h,a,l,p,&conwr )
+Metrics metrics;		// counters for the metrics file
+#define WriteCon( h, t, l ) \
+  (++metrics.con_calls, metrics.con_chars += (l), \
+   WriteConsole( h, t, l, &conwr, NULL ))
+#define FillConChar( h, c, l, p ) \
+  (++metrics.con_calls, metrics.con_chars += (l), \
+   FillConsoleOutputCharacter( h, c, l, p, &conwr ))
+#define FillConAttr( h, a, l, p ) \
+  (++metrics.con_calls, metrics.con_chars += (l), \
+   FillConsoleOutputAttribute( h, a, l, p, &conwr ))
 
 HANDLE	hConIn, hConOut;	// handles to keyboard input and screen output
 HANDLE	hConWid, hConWid1;	// output handles to determine character width
@@ -300,6 +486,14 @@ BOOL	hidden_cmd;		// prevent writing newline for Hidden/HiddenEx
 
 Line	line;			// line being edited
 DWORD	max;			// maximum size of above
+PBYTE	lex_map;		// flags for each character of the line
+DWORD	lex_max;		// size of above
+PCWSTR	lex_txt;		// line the flags were made for
+DWORD	lex_len;		// and its length
+DWORD	lex_gen;		// and its generation
+DWORD	line_gen;		// changed by every write to the line
+
+#define LEX_QUOTE	1	// quote not escaped by a backslash
 DWORD	dispbeg, dispend;	// beginning and ending position to display
 DWORD	cellend;		// ending character cell position
 Line	selected;		// the selection text
@@ -307,8 +501,16 @@ Line	selected;		// the selection text
 BOOL	kbd;			// is input from the keyboard?
 BOOL	def_macro;		// defining a macro?
 Line	mcmd;			// buffer for multiple commands
+PWSTR	brace_buf, brace_tmp;	// buffers for brace expansion
+DWORD	brace_max, brace_tmpmax;// size of above
+PWSTR	macro_buf;		// buffer for building a macro line
+DWORD	macro_max;		// size of above
+PWSTR	esc_buf;		// buffer for removing escapes and quotes
+DWORD	esc_max;		// size of above
 int	lastm;			// previous macro listed was multi-line
 COORD	lastc;			// cursor position of previous command
+BOOL	lastc_known;		// lastc.X was read at the newline
+BOOL	end_space;		// previous output ended with a space
 
 BOOL	found_quote;		// true if get_string found a quote
 
@@ -322,6 +524,11 @@ int	check_break;		// Control+Break received?
 BOOL	trap_break;		// pass it on?
 
 Line	envvar; 		// buffer for environment variable
+PWSTR	env_block;		// snapshot of the environment
+DWORD	env_size;		// length of above (including final NUL)
+PEnvEnt env_ent;		// the variables in the snapshot
+PEnvEnt* env_hash;		// buckets of above
+DWORD	env_buckets;		// number of buckets (a power of two)
 
 
 #define ESCAPE		'^'     // character to treat next character literally
@@ -695,6 +902,7 @@ void execute_lsth( DWORD );
 void execute_lstk( DWORD );
 void execute_lstm( DWORD );
 void execute_lsts( DWORD );
+void execute_lstt( DWORD );
 void execute_rsta( DWORD );
 void execute_rsth( DWORD );
 void execute_rstm( DWORD );
@@ -716,6 +924,7 @@ const Cfg internal[] = {
   { L"lstk",    (int)execute_lstk },    // list keys
   { L"lstm",    (int)execute_lstm },    // list macros
   { L"lsts",    (int)execute_lsts },    // list symbols
+  { L"lstt",    (int)execute_lstt },    // list timings
   { L"rsta",    (int)execute_rsta },    // reset associations
   { L"rsth",    (int)execute_rsth },    // reset history
   { L"rstm",    (int)execute_rstm },    // reset macros
@@ -737,6 +946,7 @@ const IntFunc internal_funcs[] = {
   execute_lstk,
   execute_lstm,
   execute_lsts,
+  execute_lstt,
   execute_rsta,
   execute_rsth,
   execute_rstm,
@@ -758,10 +968,11 @@ const Cfg internal[] = {
   { L"lstk",    11 },
   { L"lstm",    12 },
   { L"lsts",    13 },
-  { L"rsta",    14 },
-  { L"rsth",    15 },
-  { L"rstm",    16 },
-  { L"rsts",    17 },
+  { L"lstt",    14 },
+  { L"rsta",    15 },
+  { L"rsth",    16 },
+  { L"rstm",    17 },
+  { L"rsts",    18 },
 };
 #endif
 
@@ -784,11 +995,14 @@ void  copy_chars( PCWSTR, DWORD );	// set line to string
 void  remove_chars( DWORD, DWORD );	// remove characters from line
 DWORD insert_chars( DWORD, PCWSTR, DWORD );	    // add string to line
 DWORD replace_chars( DWORD, DWORD, PCWSTR, DWORD ); // replace string w/ another
+void  put_chars( DWORD, PCWSTR, DWORD ); // overwrite without undo
+void  put_char( DWORD, WCHAR ); 	// overwrite one without undo
 char* get_key( PKey );			// read a key
 WCHAR process_keypad( WORD );		// translate Alt+Keypad to character
 void  edit_line( void );		// read and edit line from the keyboard
 void  display_prompt( void );		// re-display the original prompt
 void  remove_prompt( DWORD );		// wipe out the prompt
+SHORT text_end( SHORT );		// column after the text on a row
 
 
 // Undo
@@ -803,17 +1017,28 @@ BOOL undo_redo( PUndoInfo, int* );	// undo/redo a group
 
 // Definitions (macro, symbol and association)
 
-PDefine sym_head, mac_head, assoc_head; 	// heads of the various lists
-PDefine macro_stk;				// stack of executing macros
-
-PDefine add_define( PDefine*, DWORD, DWORD );	// add definition to list
-PDefine find_define( PDefine*, DWORD, DWORD );	// find definition in list
-PDefine find_assoc( PCWSTR, DWORD );		// find extension in list
-void	del_define( PDefine* ); 		// delete definition from list
-void	delete_define( PDefine*, DWORD );	// delete list of definitions
-void	reset_define( PDefine* );		// wipe all definitions
+Dict	syms, macs, assocs; 			// the various definitions
+ExtMap	assoc_exts;				// extensions of the associations
+PMacroCall macro_stk;				// stack of executing macros
+
+DWORD	hash_name( PCWSTR, DWORD );		// hash a name, ignoring case
+PDefine new_define( PCWSTR, DWORD );		// allocate a definition
+BOOL	grow_dict( PDict );			// double the number of buckets
+void	chain_define( PDict, PDefine ); 	// put definition in its bucket
+void	unchain_define( PDict, PDefine );	// take definition from its bucket
+PDefine add_define( PDict, DWORD, DWORD );	// add definition to set
+PDefine find_define( PDict, DWORD, DWORD );	// find definition in set
+PDefine find_assoc( PCWSTR, DWORD );		// find extension in associations
+BOOL	grow_exts( PExtMap );			// double the number of buckets
+BOOL	index_exts( PExtMap, PDefine, PCWSTR, DWORD ); // add extensions
+void	unindex_exts( PExtMap, PDefine );	// remove association's extensions
+PExt	find_ext( PExtMap, PCWSTR, DWORD );	// find extension in index
+void	reset_exts( PExtMap );			// remove every extension
+void	del_define( PDict, PDefine );		// delete definition from set
+void	delete_define( PDict, DWORD );		// delete list of definitions
+void	reset_define( PDict );			// wipe all definitions
 void	list_define( PDefine, WCHAR );		// display a definition
-void	list_defines( PDefine*, DWORD );	// display a list of definitions
+void	list_defines( PDict, DWORD );		// display a list of definitions
 PLineList add_line( DWORD );			// add a line to the line list
 void	free_linelist( PLineList );		// free memory used by line list
 
@@ -824,26 +1049,133 @@ BOOL read_cmdfile( PCWSTR );		// read the file
 BOOL get_file_line( BOOL );		// read the line from file
 void get_next_line( void );		// get next line of input
 void get_macro_line( BOOL );		// input coming from a macro
+PMacroTmpl compile_macro( PLineList );	// split macro line into pieces
+PCWSTR macro_part( MacroPart*, PCWSTR, LPDWORD ); // text of a piece
 void pop_macro( void ); 		// macro finished, remove it from stack
 
 
+// Configuration cache
+
+PBYTE cache_buf;			// the cache being written
+DWORD cache_len, cache_max;		// its length and size
+BOOL  cache_ok; 			// has it all been written?
+BOOL  cfg_read; 			// has a configuration been read?
+BOOL  cfg_listed;			// has the configuration listed anything?
+BOOL  cfg_unhist;			// has it reset or deleted history?
+DWORD cache_hist;			// history lines the configuration added
+PDict const cache_dicts[] = { &macs, &syms, &assocs }; // order of the cache
+HANDLE cfg_loaded;			// the files below have been read
+PBYTE pre_cfg, pre_cache;		// configuration & cache read by loader
+DWORD pre_cfg_size, pre_cache_size;	// their sizes
+FILETIME pre_cfg_time;			// configuration's last write time
+
+DWORD hash_bytes( const void*, DWORD );	// hash some memory
+PBYTE read_whole( PCWSTR, LPDWORD, FILETIME* ); // read an entire file
+DWORD first_section( PBYTE, DWORD, LPDWORD ); // find the first '#' line
+DWORD key_offset( char* );		// position of a key within the keymaps
+char* offset_key( DWORD );		// key at a position within the keymaps
+BOOL  load_cache( PCWSTR, CacheHdr*, PCWSTR ); // apply the cache
+BOOL  check_cache( PBYTE, DWORD, DWORD ); // can the cache be trusted?
+BOOL  cache_dword( PBYTE*, PBYTE, LPDWORD ); // read a number from the cache
+BOOL  cache_skip( PBYTE*, PBYTE, DWORD ); // move past some of the cache
+BOOL  cache_text( PBYTE*, PBYTE );	// move past a length and its text
+void  save_cache( PCWSTR, const CacheHdr*, PBYTE ); // write the cache
+void  index_sections( PBYTE, const CacheHdr* ); // add the directories
+void  put_cache( const void*, DWORD );	// add memory to the cache
+void  put_text( PCWSTR, DWORD );	// add a length and its text
+
+
+// Start-up timing
+
+LONGLONG time_last;			// when the current phase started
+
+void time_phase( int ); 		// add the time to a phase
+void time_ready( void );		// the first line is ready to edit
+
+
+// Latency statistics
+
+Latency  lat_func[LastFunc];		// each function, from key to display
+Latency  lat_extra[3];			// parts of some functions & the line
+LONGLONG lat_freq;			// performance counter frequency
+
+#define LAT_FIND   0			// find_files
+#define LAT_SEARCH 1			// search_history & find_history
+#define LAT_EXPAND 2			// multi_cmd & expand_line
+
+LONGLONG lat_now( void );		// the performance counter
+void	 lat_add( Latency*, LONGLONG ); // add the time since the counter
+void	 list_latency( PCWSTR, const Latency* ); // display one
+int	 lat_percentile( const Latency*, int ); // bucket of a percentile
+void	 list_bound( int );		// display a bucket's bound
+
+
+// Metrics
+
+// Names of the counters, in the order of Metrics.
+const PCSTR metric_str[METRICS] =
+{
+  "lines", "keys", "console_calls", "console_chars", "completions",
+  "completion_us", "history_lines", "history_bytes", "macros", "symbols",
+  "associations",
+};
+
+HANDLE mtr_timer;			// timer to write the metrics file
+DWORD  mtr_timer_secs;			// its period
+HANDLE mtr_event, mtr_wait;		// METRICS_EVENT and the wait on it
+
+void count_metrics( void );		// update the counters that are totals
+__declspec(dllexport)
+BOOL write_metrics( PCWSTR );		// write every instance's counters
+void set_metrics_timer( void ); 	// start/stop/change the timer
+VOID CALLBACK metrics_timer( PVOID, BOOLEAN ); // write the file
+void watch_metrics( void );		// wait for CMDread -m to change it
+VOID CALLBACK metrics_changed( PVOID, BOOLEAN ); // -m has changed it
+
+
+// Instance registry
+
+PInstance instance;			// our entry (if there was one free)
+
+void claim_instance( void );		// find an entry for this process
+BOOL stale_instance( PInstance );	// entry from a process that's gone?
+void publish_status( void );		// copy the status to our entry
+void release_instance( void );		// free our entry
+__declspec(dllexport)
+BOOL copy_instance( int, PInstance );	// consistent copy of an entry
+#define COPY_TRIES 100			// attempts before giving up on one
+
+
 // Line output
 
 void multi_cmd( void ); 		// separate multiple commands
 void dosify( void );			// convert UNIX-style command to Windows
-BOOL brace_expansion( void );		// expand the first set of braces
+int  brace_expansion( LPDWORD, PWCHAR ); // expand the next set of braces
 void expand_braces( void );		// perform brace expansion
 BOOL associate( void ); 		// perform filename association
 BOOL expand_symbol( void );		// expand a symbol to its definition
 BOOL expand_macro( void );		// expand a macro to its definition
 BOOL internal_cmd( void );		// process internal command
 void expand_vars( BOOL );		// expand environment vars and symbols
+void expand_line( void );		// expand until there's nothing to expand
+BOOL seen_define( PDefine );		// has definition been expanded already?
+PMemo find_memo( DWORD );		// find a remembered expansion
+void add_memo( DWORD, DWORD );		// remember an expansion
+
+Memo	memo = { &memo, &memo };	// remembered expansions
+int	memos;				// number of above
+PWSTR	memo_in;			// copy of the line before expansion
+DWORD	memo_max;			// size of above
+DWORD	defs_gen;			// changes when definitions might change
+PDefine expanded[EXPANSIONS];		// definitions expanded in this line
+int	expansions;			// number of above
 
 
 // History
 
-History  history = { &history, &history, { 0 } }; // constant empty line
+History  history = { &history, &history, 0 }; // constant empty line
 int	 histsize;				// number of lines in history
+#define  HIST_BYTES( h ) (sizeof(History) + WSZ((h)->len)) // memory used
 #define  HISTSIZE 1000				// restrict the file to this
 
 PHistory new_history( PCWSTR, DWORD );		// allocate new history item
@@ -852,11 +1184,39 @@ void	 add_to_history( BOOL );		// add current line to history
 PHistory search_history( PHistory, DWORD, BOOL ); // search history for match
 PHistory find_history( PHistory, int*, DWORD, BOOL );
 void	 copy_parent_history( void );		// initial history from parent
+void	 copy_history_list( HANDLE, PHistory, PWSTR*, LPDWORD ); // one list
+
+History  loaded = { &loaded, &loaded, 0 };	// history read in the background
+int	 loaded_size;				// number of lines in above
+HANDLE	 loader;				// thread reading it
+LONG	 loader_done;				// has it finished?
+#define  PARENT_WAIT 1000			// ms to wait for a parent to load
+
+void	 start_loader( BOOL );			// read the files in background
+DWORD WINAPI load_files( LPVOID );		// the thread to read them
+void	 append_history( PCWSTR, DWORD );	// add line to loaded history
+void	 merge_history( void );			// put it before the history
+void	 use_history( void );			// merge it if it's not yet
+
+Token	 tokens;				// root of the token index
+#define  TOKEN_MIN 2				// shortest token to index
+#define  TOKEN_MAX 260				// longest token to index
+
+void	 index_history( PCWSTR, DWORD, int );	// add or remove a line's tokens
+void	 add_token( PCWSTR, DWORD, int );	// add or remove a token
+void	 free_tokens( PToken ); 		// delete the index
+BOOL	 list_tokens( PToken, PToken**, int*, int* ); // tokens beneath one
+int	 token_cmp( const void*, const void* ); // most used first
+int	 find_tokens( DWORD );			// complete from the index
 
 
 // Filename completion
 
-PHistory fname; 		// list of found filenames and initial pattern
+PFName	 fname; 		// initial pattern, then the found filenames
+int	 fname_size;		// number of entries allocated for above
+PWSTR	 fname_pool;		// text of the names
+DWORD	 fname_used, fname_room; // length and size of above
+#define  FNAME( n ) (fname_pool + fname[n].ofs)
 DWORD	 fname_pos, path_pos;	// position in line of start of filename/path
 WCHAR	 dirchar = '\\';        // character to use for directory indicator
 int	 fname_max, fname_cnt;	// longest name and number of names found
@@ -864,8 +1224,103 @@ DWORD	 assoc_pos;		// position of the association within the list
 PWCHAR	 flist; 		// open dialog filenames
 #define  FLIST_LEN 2048 	// size of flist
 
-BOOL match_file( PCWSTR, PCWSTR, DWORD, BOOL, BOOL, PHANDLE, PWIN32_FIND_DATA );
+// Names are found on a separate thread, so a key press can cancel a slow
+// search.  The job is shared between the editor and the worker; whoever
+// releases it last frees it.
+typedef struct
+{
+  LONG	 refs;			// number of owners (editor and worker)
+  LONG	 cancel;		// editor no longer wants the names
+  BOOL	 done;			// worker has finished
+  HANDLE ready; 		// signalled when names are available
+  CRITICAL_SECTION cs;		// protects names, len, max & done
+  PWSTR  names; 		// found names: 'd' or 'f', name, NUL
+  DWORD  len, max;		// length and size of above
+  BOOL	 dirs, exe;		// only directories or executables wanted
+  PWSTR  spec;			// search specification
+  DWORD  dirlen;		// length of the path portion of spec
+  PWSTR  ext;			// extensions to match or ignore
+  DWORD  extlen;		// length of above
+  PWSTR  assoc; 		// extensions of the associations
+  DWORD  assoclen;		// length of above
+  ExtMap exts;			// index of ext & assoc for executables
+  DWORD  error; 		// why the search failed
+  LONG	 opened;		// FindFirstFile has returned
+  WCHAR  sep;			// separator for names in subdirectories
+  PWSTR* comp;			// components of a recursive search
+  int	 comps; 		// number of above (0 for a normal search)
+  LONG	 found; 		// number of names found
+} FindJob, *PFindJob;
+
+// Wildcards in the directories (including "**" for any number of them) are
+// searched by several walkers, each with its own queue of directories.  A
+// walker without any work takes it from the others, or waits for some to be
+// queued.
+typedef struct
+{
+  PWSTR  dir;			// directory relative to the base (with separator)
+  DWORD  len;			// length of above
+  int	 comp;			// component to match within it
+  int	 depth; 		// number of directories below the base
+} WalkDir, *PWalkDir;
+
+typedef struct
+{
+  CRITICAL_SECTION cs;		// protects the rest
+  PWalkDir dir; 		// directories waiting to be searched
+  int	 top, bottom;		// others take from the top, owner the bottom
+  int	 max;			// size of dir
+} WalkQueue, *PWalkQueue;
+
+typedef struct
+{
+  PFindJob   job;		// the names being found
+  PWalkQueue queue;		// a queue for each walker
+  int	     walkers;		// number of above
+  LONG	     next_id;		// walker's queue
+  LONG	     pending;		// directories queued or being searched
+  HANDLE     work;		// semaphore counting the queued directories
+  volatile BOOL done;		// no more to search, the walkers can finish
+} Walk, *PWalk;
+
+#define  WALKERS    4		// maximum number of walkers
+#define  WALK_DEPTH 16		// maximum directories below the base
+#define  WALK_NAMES 1000	// maximum names a recursive search finds
+
+// Paths that could not be searched are remembered for a while, so repeated
+// completion on a dead share doesn't block every time.
+typedef struct
+{
+  PWSTR  path;			// full path, ending with a backslash
+  DWORD  len;			// length of above
+  DWORD  expires;		// tick count when it can be tried again
+} BadPath;
+
+#define  BAD_PATHS    8 	// number of paths to remember
+#define  BAD_PATH_TTL 60000	// milliseconds to remember them
+#define  FIND_TIMEOUT 2000	// milliseconds to wait for the first name
+#define  FIND_SLOW    250	// failing takes at least this long to be bad
+
+BadPath  bad_path[BAD_PATHS];
+
+BOOL match_file( PFindJob, PCWSTR, DWORD, BOOL, PHANDLE, PWIN32_FIND_DATA );
 				// find a file, possibly matching its extension
+PFindJob start_find( DWORD, int, BOOL, BOOL ); // start finding the names
+DWORD WINAPI find_worker( LPVOID ); // thread to find the names
+BOOL  add_name( PFindJob, PCWSTR, DWORD, PWIN32_FIND_DATA ); // name for editor
+void  walk( PFindJob );		// recursive search
+DWORD WINAPI walker( LPVOID );	// search directories from the queues
+BOOL  walk_push( PWalk, int, PCWSTR, DWORD, PCWSTR, int, int ); // queue a dir
+BOOL  walk_pop( PWalk, int, PWalkDir ); // get a directory to search
+void  walk_dir( PWalk, int, PWalkDir ); // search a directory
+void  release_job( PFindJob );	// free the job once both sides are done
+BOOL  key_pending( void );	// has a key been pressed?
+DWORD full_dir( PCWSTR, DWORD, PWSTR ); // directory to remember as bad
+BOOL  is_bad_path( PCWSTR, DWORD ); // has the path recently failed?
+void  add_bad_path( PCWSTR, DWORD ); // remember a path that failed
+BOOL  unreachable( DWORD );	// was the path out of reach?
+BOOL  add_fname( int, PCWSTR, DWORD, DWORD, DWORD ); // store found name
+int   fname_cmp( const void*, const void* ); // sort the names
 int   find_files( int*, int );	// find matching files and common prefix
 void  list_files( void );	// list all files
 int   calc_lines( void );	// determine number of lines for the listing
@@ -891,10 +1346,13 @@ DWORD skip_blank( DWORD );		// skip over spaces and tabs
 DWORD skip_nonblank( DWORD );		// skip over everything not space/tab
 DWORD skip_nondelim( DWORD );		// skip over everything not a delimiter
 BOOL  is_quote( int );			// quote character?
+BOOL  lex_line( void ); 		// flag the characters of the line
 DWORD get_string( DWORD, LPDWORD, BOOL ); // retrieve argument
 void  un_escape( PCWSTR );		// remove the escape character
 BOOL  match_ext( PCWSTR, DWORD, PCWSTR, DWORD ); // match extension in list
 DWORD get_env_var( PCWSTR, PCWSTR );	// get environment variable
+void  snap_env( void ); 		// take a snapshot of the environment
+PEnvEnt find_env( PCWSTR, DWORD );	// find variable in the snapshot
 void  show_error( PCWSTR, DWORD, DWORD ); // show an internal command error
 void  set_codepage( void );		// set output code page (for printf)
 DWORD display_length( PCWSTR, DWORD, DWORD ); // get the display length for DBCS
@@ -956,6 +1414,7 @@ void copy_chars( PCWSTR str, DWORD cnt )
   }
   memcpy( line.txt, str, WSZ(cnt) );
   line.len = cnt;
+  ++line_gen;
   set_display_marks( 0, line.len );
   reset_undo();
 }
@@ -970,6 +1429,7 @@ void remove_chars( DWORD pos, DWORD cnt )
   add_to_undo( UNDOINSERT, pos, cnt );
   memcpy( line.txt + pos, line.txt + pos + cnt, WSZ(line.len - pos - cnt) );
   line.len -= cnt;
+  ++line_gen;
 }
 
 
@@ -984,6 +1444,7 @@ DWORD insert_chars( DWORD pos, PCWSTR str, DWORD cnt )
   memmove( line.txt + pos + cnt, line.txt + pos, WSZ(line.len - pos) );
   memcpy( line.txt + pos, str, WSZ(cnt) );
   line.len += cnt;
+  ++line_gen;
   set_display_marks( pos, line.len );
   add_to_undo( UNDODELETE, pos, cnt );
   return cnt;
@@ -1000,6 +1461,7 @@ DWORD replace_chars( DWORD pos, DWORD old, PCWSTR str, DWORD cnt )
       remove_chars( pos + cnt, old - cnt );
     add_to_undo( UNDOINSERT, pos, cnt );
     memcpy( line.txt + pos, str, WSZ(cnt) );
+    ++line_gen;
     add_to_undo( UNDODELETE, pos, cnt );
   }
   else
@@ -1008,12 +1470,31 @@ DWORD replace_chars( DWORD pos, DWORD old, PCWSTR str, DWORD cnt )
     add_to_undo( UNDOINSERT, pos, old );
     add_to_undo( UNDODELETE, pos, old );
     memcpy( line.txt + pos, str, WSZ(old) );
+    ++line_gen;
     cnt = old + insert_chars( pos + old, str + old, cnt - old );
   }
   return cnt;
 }
 
 
+// Overwrite cnt characters at pos with str, leaving the undo and display to
+// the caller (if the line is being edited at all).  Every write to the line
+// goes through here or the above, so the generation tells when it changed.
+void put_chars( DWORD pos, PCWSTR str, DWORD cnt )
+{
+  memcpy( line.txt + pos, str, WSZ(cnt) );
+  ++line_gen;
+}
+
+
+// Overwrite the character at pos, as above.
+void put_char( DWORD pos, WCHAR ch )
+{
+  line.txt[pos] = ch;
+  ++line_gen;
+}
+
+
 // Reset the undo/redo pointers, making empty lists.
 void reset_undo()
 {
@@ -1227,6 +1708,8 @@ char* get_key( PKey chfn )
       }
     } while (rec.EventType != KEY_EVENT || !rec.Event.KeyEvent.bKeyDown ||
 	     VK == VK_SHIFT || VK == VK_CONTROL || VK == VK_MENU);
+    ++metrics.keys;
+    use_history();
   }
   --rec.Event.KeyEvent.wRepeatCount;
 
@@ -1441,7 +1924,7 @@ void edit_line( void )
   int	 cont_recall = 1;		// should auto-recall remain active?
   BOOL	 failed = FALSE;		// did auto-recall fail to match?
   PHistory hist, shist; 		// position within history, of match
-  PHistory fnp = NULL;			// list of completed filenames
+  int	 fni = 0;			// index of completed filename
   PWSTR  fnm;				// current filename
   int	 compl = 0, name = 0;		// filename completion flags
   BOOL	 quote, fnoq = FALSE, pq = FALSE; // filename quoting flags
@@ -1451,6 +1934,8 @@ void edit_line( void )
   DWORD  markpos = ~0, markbeg = 0, markend = 0; // the selection positions
   BOOL	 keep_mark;
   DWORD  hlen;				// length of old command to hide
+  LONGLONG started;			// when the function started
+  int	 tfn;				// the function being timed
 
   GetConsoleScreenBufferInfo( hConOut, &screen );
   if (show_prompt)
@@ -1487,6 +1972,8 @@ void edit_line( void )
     }
     else
       key = get_key( &chfn );
+    started = lat_now();
+    tfn = chfn.fn;
 
     dispbeg = ~0;			// nothing to display
     dispend = cellend = hlen = 0;
@@ -1987,10 +2474,15 @@ void edit_line( void )
 	if (compl == 2 || name == 1 || name == 2)
 	{
 	  start = pos;		// prefix was added if pos moves
-	  if ((end = find_files( &pos, !(name & 2) )) == -1)
+	  end = find_files( &pos, !(name & 2) );
+	  // If there's no such file, try an argument from the history.
+	  if (end == -1 && (name & 2))
+	    end = find_tokens( pos );
+	  if (end == -1 || end == -3)
 	  {
 	    compl = 0;
-	    bell();
+	    if (end == -1)
+	      bell();
 	    break;
 	  }
 	  fnoq = pq = FALSE;
@@ -1999,17 +2491,17 @@ void edit_line( void )
 	  else
 	  {
 	    // Check if one of the characters after the prefix needs quoting.
-	    for (fnp = fname->next; fnp != fname; fnp = fnp->next)
+	    for (fni = 1; fni <= fname_cnt; ++fni)
 	    {
-	      if (fnp->flen > end && quote_needed( fnp->line + end, 1 ))
+	      if (fname[fni].flen > end && quote_needed( FNAME(fni) + end, 1 ))
 	      {
 		pq = TRUE;
 		break;
 	      }
 	    }
 	  }
-	  fnp = fname;
-	  fnm = fname->next->line;
+	  fni = 0;
+	  fnm = FNAME(1);
 	  if (fname_cnt == 1 || end == -2 ||
 	      chfn.fn == CycleBack || chfn.fn == CycleDirBack)
 	  {
@@ -2022,12 +2514,12 @@ void edit_line( void )
 	    }
 	    if (chfn.fn == CycleBack || chfn.fn == CycleDirBack)
 	    {
-	      fnp = fname->prev;
-	      fnm = fnp->line;
+	      fni = fname_cnt;
+	      fnm = FNAME(fni);
 	    }
 	    else
-	      fnp = fname->next;
-	    end = fnp->flen;
+	      fni = 1;
+	    end = fname[fni].flen;
 	    start = -1; 		// no prefix when immediately completed
 	  }
 	}
@@ -2039,13 +2531,13 @@ void edit_line( void )
 	else
 	{
 	  if (chfn.fn == Cycle || chfn.fn == CycleDir)
-	    fnp = fnp->next;
+	    fni = (fni == fname_cnt) ? 0 : fni + 1;
 	  else // (chfn.fn == CycleBack || chfn.fn == CycleDirBack)
-	    fnp = fnp->prev;
-	  if (fnp == fname)
+	    fni = (fni == 0) ? fname_cnt : fni - 1;
+	  if (fni == 0)
 	    bell();
-	  fnm = fnp->line;
-	  end = fnp->flen;
+	  fnm = FNAME(fni);
+	  end = fname[fni].flen;
 	}
 	quote = (pq || quote_needed( fnm, end ));
 	if (quote && !fnoq)
@@ -2065,7 +2557,7 @@ void edit_line( void )
 	if (dir && option.no_slash)
 	  --end;
 	pos = fname_pos + replace_chars( fname_pos, pos - fname_pos, fnm, end );
-	if (!dir && fnp != fname)
+	if (!dir && fni != 0)
 	  pos += insert_chars( pos, L"\" " + 1 - quote, quote + 1 );
 	// Create a separate group for the prefix.
 	if (compl == 2 && start != -1 && start != pos)
@@ -2191,6 +2683,7 @@ void edit_line( void )
       break;
 
       case VarSubst:
+	expansions = 0;
 	expand_braces();
 	expand_vars( TRUE );
 	associate();
@@ -2272,7 +2765,7 @@ void edit_line( void )
       }
       if (dispend)
       {
-	line.txt[pos++] = chfn.ch;
+	put_char( pos++, chfn.ch );
 	slen++;
 	if (find)
 	{
@@ -2282,7 +2775,7 @@ void edit_line( void )
 	    --pos;
 	    --slen;
 	    if (pos < hist->len)
-	      line.txt[pos] = hist->line[pos];
+	      put_char( pos, hist->line[pos] );
 	    bell();
 	  }
 	  else
@@ -2458,6 +2951,7 @@ void edit_line( void )
       SetConsoleCursorPosition( hConOut,
 				(chfn.fn == Wipe) ? screen.dwCursorPosition
 				: line_to_scr( (done) ? line.len : pos ) );
+    lat_add( lat_func + tfn, started );
   }
   undoing = NULL;
 
@@ -2537,8 +3031,11 @@ void remove_prompt( DWORD extra )
     FillConChar( hConOut, ' ', erase_len, erase_coord );
     FillConAttr( hConOut, screen.wAttributes, erase_len, erase_coord );
 
-    // Restore the position prior to writing it.
+    // Restore the position prior to writing it (where the previous command's
+    // output finished).
     lastc.Y = erase_coord.Y - 1;
+    if (!hidden_cmd && !lastc_known)
+      lastc.X = text_end( lastc.Y );
     SetConsoleCursorPosition( hConOut, (hidden_cmd) ? erase_coord : lastc );
 
     erase_prompt = 0;
@@ -2546,6 +3043,33 @@ void remove_prompt( DWORD extra )
 }
 
 
+// Find where the text ends on row y (trailing spaces are assumed to be
+// padding).  Used to recover where the output of the previous command
+// finished, rather than asking the cursor position for every newline.  If
+// CMD.EXE's own output ended with a space the cursor was asked for instead,
+// but trailing spaces written by another program will still be lost.
+SHORT text_end( SHORT y )
+{
+  WCHAR buf[80];
+  COORD c;
+  DWORD i;
+
+  c.Y = y;
+  for (c.X = screen.dwSize.X; c.X > 0;)
+  {
+    i = min( c.X, lenof(buf) );
+    c.X -= (SHORT)i;
+    if (!ReadConsoleOutputCharacter( hConOut, buf, i, c, &conwr ))
+      break;
+    while (i != 0)
+      if (buf[--i] != ' ')
+	return c.X + (SHORT)i + 1;
+  }
+
+  return 0;
+}
+
+
 // ------------------------------   History   --------------------------------
 
 
@@ -2568,8 +3092,10 @@ PHistory new_history( PCWSTR txt, DWORD len )
 // Remove the item from the history.  Should not be the history itself.
 void remove_from_history( PHistory h )
 {
+  index_history( h->line, h->len, -1 );
   h->prev->next = h->next;
   h->next->prev = h->prev;
+  metrics.hist_bytes -= HIST_BYTES( h );
   free( h );
   --histsize;
 }
@@ -2598,6 +3124,8 @@ void add_to_history( BOOL search )
     if (!h)
       return;
     ++histsize;
+    metrics.hist_bytes += HIST_BYTES( h );
+    index_history( h->line, h->len, 1 );
   }
   else
   {
@@ -2619,6 +3147,7 @@ PHistory search_history( PHistory hist, DWORD len, BOOL back )
 {
   PHistory h;
   BOOL	 fnd;
+  LONGLONG started = lat_now();
 
   h = hist;
   do
@@ -2627,6 +3156,7 @@ PHistory search_history( PHistory hist, DWORD len, BOOL back )
     fnd = (h->len >= len && _wcsnicmp( h->line, line.txt, len ) == 0);
   } while (!fnd && h != hist);
 
+  lat_add( lat_extra + LAT_SEARCH, started );
   return (fnd) ? h : NULL;
 }
 
@@ -2641,6 +3171,7 @@ PHistory find_history( PHistory hist, int* pos, DWORD len, BOOL back )
   PCWSTR txt;
   WCHAR  c;
   DWORD  p;
+  LONGLONG started = lat_now();
 
   p = *pos - len;
   txt = line.txt + p;
@@ -2654,23 +3185,242 @@ PHistory find_history( PHistory hist, int* pos, DWORD len, BOOL back )
 	  _wcsnicmp( txt + 1, h->line + p + 1, len - 1 ) == 0)
       {
 	*pos = p + len;
+	lat_add( lat_extra + LAT_SEARCH, started );
 	return h;
       }
     }
     h = (back) ? h->prev : h->next;
     if (h == hist)
+    {
+      lat_add( lat_extra + LAT_SEARCH, started );
       return NULL;
+    }
+  }
+}
+
+
+// Add (uses is 1) or remove (uses is -1) the tokens of the history line txt
+// (of length len).  The line is split the same way as get_string, with the
+// quotes removed.
+void index_history( PCWSTR txt, DWORD len, int uses )
+{
+  WCHAR tok[TOKEN_MAX];
+  DWORD pos, tlen, slash;
+  BOOL	quote;
+
+  pos = 0;
+  while (pos < len)
+  {
+    while (pos < len && isblank( txt[pos] ))
+      ++pos;
+    tlen = slash = 0;
+    quote = FALSE;
+    for (; pos < len; ++pos)
+    {
+      // An odd number of backslashes before the quote treats it literally.
+      if (txt[pos] == '"' && !(slash & 1))
+	quote = !quote;
+      else if (!quote && isblank( txt[pos] ))
+	break;
+      else if (tlen < TOKEN_MAX)
+	tok[tlen++] = txt[pos];
+      slash = (txt[pos] == '\\') ? slash + 1 : 0;
+    }
+    if (tlen >= TOKEN_MIN && tlen < TOKEN_MAX)
+      add_token( tok, tlen, uses );
+  }
+}
+
+
+// Add uses to the count of the token txt (of length len), removing it from
+// the index when it's no longer used.
+void add_token( PCWSTR txt, DWORD len, int uses )
+{
+  PToken  path[TOKEN_MAX];
+  PToken* link;
+  PToken  t;
+  DWORD   j;
+  WCHAR   ch;
+
+  t = &tokens;
+  for (j = 0; j < len; ++j)
+  {
+    ch = towlower( txt[j] );
+    for (link = &t->child; *link && (*link)->ch < ch; link = &(*link)->next) ;
+    if (!*link || (*link)->ch != ch)
+    {
+      if (uses < 0)			// not present, nothing to remove
+	return;
+      t = calloc( 1, sizeof(Token) );
+      if (!t)
+	return;
+      t->ch   = ch;
+      t->next = *link;
+      *link   = t;
+    }
+    path[j] = t = *link;
+  }
+
+  if (uses > 0)
+  {
+    if (t->uses == 0)
+    {
+      t->txt = new_txt( txt, len );
+      if (!t->txt)
+	return;
+      t->len = (WORD)len;
+    }
+    ++t->uses;
+    return;
+  }
+
+  if (t->uses == 0 || --t->uses != 0)
+    return;
+  free( t->txt );
+  t->txt = NULL;
+
+  // Remove the nodes that no longer lead anywhere.
+  while (len-- > 0 && !path[len]->uses && !path[len]->child)
+  {
+    link = &((len == 0) ? &tokens : path[len-1])->child;
+    while (*link != path[len])
+      link = &(*link)->next;
+    *link = path[len]->next;
+    free( path[len] );
+  }
+}
+
+
+// Delete the tokens beneath t.
+void free_tokens( PToken t )
+{
+  PToken c, n;
+
+  for (c = t->child; c; c = n)
+  {
+    n = c->next;
+    free_tokens( c );
+    free( c->txt );
+    free( c );
+  }
+  t->child = NULL;
+}
+
+
+// Add the used tokens beneath (and including) t to list (of size max, with cnt
+// tokens), in alphabetical order.  Returns FALSE if there's no memory.
+BOOL list_tokens( PToken t, PToken** list, int* cnt, int* max )
+{
+  PToken* l;
+  PToken  c;
+
+  if (t->uses)
+  {
+    if (*cnt == *max)
+    {
+      l = realloc( *list, (*max + 64) * sizeof(PToken) );
+      if (!l)
+	return FALSE;
+      *list = l;
+      *max += 64;
+    }
+    (*list)[(*cnt)++] = t;
+  }
+  for (c = t->child; c; c = c->next)
+    if (!list_tokens( c, list, cnt, max ))
+      return FALSE;
+
+  return TRUE;
+}
+
+
+// Compare two tokens for qsort: most used first, then in the order of the
+// index (alphabetical, ignoring case).
+int token_cmp( const void* a, const void* b )
+{
+  PToken ta = *(const PToken*)a;
+  PToken tb = *(const PToken*)b;
+  int	 j, len, diff;
+
+  if (ta->uses != tb->uses)
+    return (ta->uses < tb->uses) ? 1 : -1;
+  len = (ta->len < tb->len) ? ta->len : tb->len;
+  for (j = 0; j < len; ++j)
+  {
+    diff = towlower( ta->txt[j] ) - towlower( tb->txt[j] );
+    if (diff)
+      return diff;
+  }
+  return ta->len - tb->len;
+}
+
+
+// Complete the argument from path_pos to pos using the tokens in the history,
+// storing them as the names (most used first).  Returns -1 if none match,
+// otherwise the length of the portion common to all of them.
+int find_tokens( DWORD pos )
+{
+  PToken* list;
+  PToken  t;
+  int	  cnt, max, prefix, j, beg;
+  DWORD   dend;
+  WCHAR   ch;
+
+  fname_used = fname_cnt = fname_max = 0;
+  fname_pos = path_pos;
+
+  t = &tokens;
+  for (j = fname_pos; t && j < pos; ++j)
+  {
+    ch = towlower( line.txt[j] );
+    for (t = t->child; t && t->ch < ch; t = t->next) ;
+    if (t && t->ch != ch)
+      t = NULL;
+  }
+  if (!t)
+    return -1;
+
+  list = NULL;
+  cnt = max = 0;
+  list_tokens( t, &list, &cnt, &max );
+  if (cnt > 1)
+    qsort( list, cnt, sizeof(PToken), token_cmp );
+  prefix = -1;
+  if (cnt && add_fname( 0, line.txt + fname_pos, pos - fname_pos, 0, 0 ))
+  {
+    for (j = 0; j < cnt; ++j)
+    {
+      dend = display_length( list[j]->txt, 0, list[j]->len );
+      if (!add_fname( fname_cnt + 1, list[j]->txt, list[j]->len, dend, 0 ))
+	break;
+      ++fname_cnt;
+      if (dend > fname_max)
+	fname_max = dend;
+      if (prefix < 0)
+	prefix = list[j]->len;
+      else
+      {
+	for (beg = 0; beg < prefix; ++beg)
+	  if (towlower( list[j]->txt[beg] ) != towlower( list[0]->txt[beg] ))
+	    break;
+	prefix = beg;
+      }
+    }
   }
+  free( list );
+
+  return (fname_cnt) ? prefix : -1;
 }
 
 
-// Create the initial history from the parent or primary process' history.
+// Read the parent or primary process' history into the loaded history.
 void copy_parent_history( void )
 {
   HANDLE   parent;
   int	   version;
-  History  hist;
-  PHistory cur;
+  LONG	   done;
+  PWSTR    buf;
+  DWORD    size, wait;
 
   parent = OpenProcess( PROCESS_VM_READ, FALSE, parent_pid );
   if (!parent ||
@@ -2689,23 +3439,51 @@ void copy_parent_history( void )
     }
   }
 
-  make_line( 0 );
-  ReadProcessMemory( parent, &history, &hist, sizeof(History), NULL );
-  while (hist.next != &history)
+  // The parent only merges the history it loaded when it first needs it
+  // (which may be never, if it's running a batch file), so copy those older
+  // lines first, once it's finished loading them.
+  done = FALSE;
+  for (wait = 0; wait < PARENT_WAIT; wait += 10)
   {
-    cur = hist.next;
-    ReadProcessMemory( parent, cur, &hist, sizeof(History), NULL );
-    if (!make_line( hist.len ))
+    if (!ReadProcessMemory( parent, &loader_done, &done, sizeof(LONG), NULL )
+	|| done)
       break;
-    ReadProcessMemory( parent, &cur->line, line.txt, WSZ(line.len), NULL );
-    add_to_history( FALSE );
+    Sleep( 10 );
   }
-  make_line( ~0 );
+
+  buf = NULL;
+  size = 0;
+  if (done)
+    copy_history_list( parent, &loaded, &buf, &size );
+  copy_history_list( parent, &history, &buf, &size );
+  free( buf );
 
   CloseHandle( parent );
 }
 
 
+// Append the lines of the parent's history list at head to the loaded
+// history, using buf (of size characters) to read them.
+void copy_history_list( HANDLE parent, PHistory head,
+			PWSTR* buf, LPDWORD size )
+{
+  History  hist;
+  PHistory cur;
+
+  if (!ReadProcessMemory( parent, head, &hist, sizeof(History), NULL ))
+    return;
+  while (hist.next != head)
+  {
+    cur = hist.next;
+    if (!ReadProcessMemory( parent, cur, &hist, sizeof(History), NULL ) ||
+	!make_length( buf, size, hist.len ) ||
+	!ReadProcessMemory( parent, &cur->line, *buf, WSZ(hist.len), NULL ))
+      break;
+    append_history( *buf, hist.len );
+  }
+}
+
+
 // Write the history to file.  Since editing this file is not really needed,
 // keep it simple and write it as binary.
 void write_history( void )
@@ -2728,21 +3506,26 @@ void write_history( void )
 }
 
 
+// Read the history file into the loaded history.
 void read_history( void )
 {
+  PWSTR buf;
+  DWORD size, len;
+
   FILE* file = _wfopen( local.hstname, L"rb" );
   if (file == NULL)
     return;
 
-  make_line( 0 );
-  while (fread( &line.len, 2, 1, file ) == 1)
+  buf = NULL;
+  size = len = 0;
+  while (fread( &len, 2, 1, file ) == 1)
   {
-    if (!make_line( line.len ))
+    if (!make_length( &buf, &size, len ))
       break;
-    fread( line.txt, WSZ(line.len), 1, file );
-    add_to_history( FALSE );
+    fread( buf, WSZ(len), 1, file );
+    append_history( buf, len );
   }
-  make_line( ~0 );
+  free( buf );
 
   fclose( file );
 }
@@ -2767,36 +3550,192 @@ void check_history( void )
 }
 
 
-// ------------------------   Filename Completion   --------------------------
+// Start a thread to read the configuration (and its cache) and the history
+// (from file, or from the parent if parent is TRUE), so the first prompt
+// doesn't have to wait for them.  If the thread can't be created, just read
+// the history now.
+void start_loader( BOOL parent )
+{
+  cfg_loaded = CreateEvent( NULL, TRUE, FALSE, NULL );
+  loader = CreateThread( NULL, 0, load_files, (LPVOID)(DWORD_PTR)parent, 0,
+			 NULL );
+  if (loader == NULL)
+  {
+    if (cfg_loaded != NULL)
+    {
+      CloseHandle( cfg_loaded );
+      cfg_loaded = NULL;
+    }
+    if (parent)
+      copy_parent_history();
+    else
+      read_history();
+    loader_done = TRUE;
+  }
+}
 
 
-// Find the files matching name (using NULL to continue), testing against the
-// extensions in extlist (if extlen is not zero; if exe is TRUE the extension
-// must be in the list, otherwise it must NOT be in the list).	If dirs is TRUE
-// only directories will be matched; if exe is TRUE only executables and assoc-
-// iated files.  The find handle is returned in fh, with fd containing the file
-// information.  Returns FALSE if no (more) names matched, TRUE otherwise.
-BOOL match_file( PCWSTR name, PCWSTR extlist, DWORD extlen, BOOL dirs, BOOL exe,
-		 PHANDLE fh, PWIN32_FIND_DATA fd )
+// The loader thread.  The configuration is only read, it's up to the first
+// read_cmdfile to apply it; the history is kept separate until merge_history.
+DWORD WINAPI load_files( LPVOID parent )
 {
-  static const WCHAR DOT[] = L".";
-  PCWSTR dot;
-  WCHAR  path[MAX_PATH], buf[MAX_PATH];
+  WCHAR cname[MAX_PATH+lenof(CACHE_EXT)];
 
-  if (name)
+  if (cfg_loaded != NULL)
   {
-    *fh = FindFirstFile( name, fd );
-    if (*fh == INVALID_HANDLE_VALUE)
-      return FALSE;
+    if (*cfgname)
+    {
+      pre_cfg = read_whole( cfgname, &pre_cfg_size, &pre_cfg_time );
+      _snwprintf( cname, lenof(cname), L"%s" CACHE_EXT, cfgname );
+      pre_cache = read_whole( cname, &pre_cache_size, NULL );
+    }
+    SetEvent( cfg_loaded );
   }
-  else if (!FindNextFile( *fh, fd ))
+
+  if (parent)
+    copy_parent_history();
+  else
+    read_history();
+  InterlockedExchange( &loader_done, TRUE );
+
+  return 0;
+}
+
+
+// Add a line to the end of the loaded history, removing the first line if
+// it's full.  A line that's already present is moved to the end instead (a
+// parent's loaded and current history may have lines in common).  Uses
+// nothing but the loaded history, so the loader can call it.
+void append_history( PCWSTR txt, DWORD len )
+{
+  PHistory h;
+
+  if (len < option.min_length)		// line is too small to be remembered
+    return;
+
+  for (h = loaded.prev; h != &loaded; h = h->prev)
+    if (h->len == len && memcmp( h->line, txt, WSZ(len) ) == 0)
+      break;
+
+  if (h != &loaded)			// found it, so relocate it
   {
-    FindClose( *fh );
-    return FALSE;
+    h->prev->next = h->next;
+    h->next->prev = h->prev;
   }
-
-  do
+  else
   {
+    if (option.histsize && loaded_size == option.histsize)
+    {
+      h = loaded.next;
+      loaded.next = h->next;
+      h->next->prev = &loaded;
+      free( h );
+      --loaded_size;
+    }
+    h = new_history( txt, len );
+    if (!h)
+      return;
+    ++loaded_size;
+  }
+  h->prev = loaded.prev;
+  h->next = &loaded;
+  loaded.prev->next = h;
+  loaded.prev = h;
+}
+
+
+// Wait for the loader, then put the loaded history before the history.  Any
+// lines already in the history are more recent, so a loaded line that is the
+// same as one of them is dropped, as are the oldest lines once it's full.
+void merge_history( void )
+{
+  PHistory h, p, n;
+  int	   cur, i;
+
+  if (loader != NULL)
+  {
+    WaitForSingleObject( loader, INFINITE );
+    CloseHandle( loader );
+    loader = NULL;
+  }
+
+  cur = histsize;
+  for (h = loaded.prev; h != &loaded; h = p)
+  {
+    p = h->prev;
+    if (!option.histsize || histsize < option.histsize)
+    {
+      for (n = history.prev, i = cur; i; --i, n = n->prev)
+	if (n->len == h->len && memcmp( n->line, h->line, WSZ(h->len) ) == 0)
+	  break;
+      if (i == 0)
+      {
+	h->prev = &history;		// make it the first line
+	h->next = history.next;
+	history.next->prev = h;
+	history.next = h;
+	++histsize;
+	metrics.hist_bytes += HIST_BYTES( h );
+	index_history( h->line, h->len, 1 );
+	continue;
+      }
+    }
+    free( h );
+  }
+  loaded.prev = loaded.next = &loaded;
+  loaded_size = 0;
+}
+
+
+// The history is needed now, so wait for it to finish being read.
+void use_history( void )
+{
+  if (loader != NULL || loaded.next != &loaded)
+  {
+    time_phase( -1 );
+    merge_history();
+    time_phase( TIME_HISTORY );
+  }
+}
+
+
+// ------------------------   Filename Completion   --------------------------
+
+
+// Find the files matching spec, whose path is dirlen characters (first is
+// TRUE to start, FALSE to continue), testing against the job's extensions (if
+// extlen is not zero; if exe is TRUE the extension must be in the list,
+// otherwise it must NOT be in the list).  If dirs is TRUE only directories
+// will be matched; if exe is TRUE only executables and associated files.  The
+// find handle is returned in fh, with fd containing the file information.
+// Returns FALSE if no (more) names matched, TRUE otherwise.  Only uses the
+// job, since it runs on the worker thread.
+BOOL match_file( PFindJob job, PCWSTR spec, DWORD dirlen, BOOL first,
+		 PHANDLE fh, PWIN32_FIND_DATA fd )
+{
+  static const WCHAR DOT[] = L".";
+  PCWSTR dot, name;
+  WCHAR  path[MAX_PATH], buf[MAX_PATH];
+
+  if (first)
+  {
+    *fh = FindFirstFile( spec, fd );
+    if (*fh == INVALID_HANDLE_VALUE)
+      job->error = GetLastError();
+    InterlockedExchange( &job->opened, TRUE );
+    if (*fh == INVALID_HANDLE_VALUE)
+      return FALSE;
+  }
+  else if (!FindNextFile( *fh, fd ))
+  {
+    FindClose( *fh );
+    return FALSE;
+  }
+
+  do
+  {
+    if (job->cancel)
+      break;
     if (fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
     {
       // Directory always succeeds, but ignore "." and "..".
@@ -2806,9 +3745,9 @@ BOOL match_file( PCWSTR name, PCWSTR extlist, DWORD extlen, BOOL dirs, BOOL exe,
 	continue;
       return TRUE;
     }
-    else if (dirs)			// not a directory, but only dirs wanted
+    else if (job->dirs) 		// not a directory, but only dirs wanted
       continue;
-    if (extlen == 0)			// not matching extension
+    if (job->extlen == 0)		// not matching extension
       return TRUE;
     for (dot = NULL, name = fd->cFileName; *name; ++name)
       if (*name == '.')
@@ -2818,10 +3757,11 @@ BOOL match_file( PCWSTR name, PCWSTR extlist, DWORD extlen, BOOL dirs, BOOL exe,
       dot  = DOT;			//  can work
       name = dot + 1;
     }
-    if (exe)
+    if (job->exe)
     {
-      if (match_ext( dot, name - dot, extlist, extlen ) ||
-	  find_assoc( dot, name - dot ))
+      if ((job->exts.count) ? find_ext( &job->exts, dot, name - dot ) != NULL
+			    : match_ext( dot, name - dot, job->ext, job->extlen ) ||
+			      match_ext( dot, name - dot, job->assoc, job->assoclen ))
       {
 	if (dot == DOT) 		// the dot is needed for association
 	  wcscat( fd->cFileName, dot );
@@ -2830,13 +3770,13 @@ BOOL match_file( PCWSTR name, PCWSTR extlist, DWORD extlen, BOOL dirs, BOOL exe,
       // Didn't find the extension in our lists, so try Windows'.
       if (dot != DOT)
       {
-	memcpy( path, line.txt + path_pos, WSZ(fname_pos - path_pos) );
-	wcscpy( path + fname_pos - path_pos, fd->cFileName );
+	memcpy( path, spec, WSZ(dirlen) );
+	wcscpy( path + dirlen, fd->cFileName );
 	if (FindExecutable( path, NULL, buf ) > (HINSTANCE)32)
 	  return TRUE;
       }
     }
-    else if (!match_ext( dot, name - dot, extlist, extlen ))
+    else if (!match_ext( dot, name - dot, job->ext, job->extlen ))
       return TRUE;
   } while (FindNextFile( *fh, fd ));
 
@@ -2845,6 +3785,461 @@ BOOL match_file( PCWSTR name, PCWSTR extlist, DWORD extlen, BOOL dirs, BOOL exe,
 }
 
 
+// Find the names for a job, adding each one to its list as it is found.
+DWORD WINAPI find_worker( LPVOID param )
+{
+  PFindJob job = param;
+  HANDLE   fh;
+  WIN32_FIND_DATA fd;
+  BOOL	   match;
+
+  if (job->comps)
+    walk( job );
+  else
+  {
+    match = match_file( job, job->spec, job->dirlen, TRUE, &fh, &fd );
+    // If nothing was found try again without the ignore list.
+    if (!match && !job->cancel && !job->exe && !job->dirs && job->extlen)
+    {
+      job->extlen = 0;
+      match = match_file( job, job->spec, job->dirlen, TRUE, &fh, &fd );
+    }
+    while (match)
+    {
+      if (!add_name( job, NULL, 0, &fd ))
+      {
+	FindClose( fh );
+	break;
+      }
+      match = match_file( job, job->spec, job->dirlen, FALSE, &fh, &fd );
+    }
+  }
+
+  EnterCriticalSection( &job->cs );
+  job->done = TRUE;
+  LeaveCriticalSection( &job->cs );
+  SetEvent( job->ready );
+
+  release_job( job );
+  return 0;
+}
+
+
+// Add the name in fd, in the directory dir (of length len), to the job's
+// list.  Returns FALSE if the search should stop (it's been cancelled, or a
+// recursive search has found enough).
+BOOL add_name( PFindJob job, PCWSTR dir, DWORD len, PWIN32_FIND_DATA fd )
+{
+  DWORD flen;
+  BOOL	more;
+
+  flen = wcslen( fd->cFileName );
+  EnterCriticalSection( &job->cs );
+  more = (!job->cancel && (job->comps == 0 || job->found < WALK_NAMES));
+  if (more && make_length( &job->names, &job->max, job->len + len + flen + 2 ))
+  {
+    job->names[job->len] =
+		(fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? 'd' : 'f';
+    memcpy( job->names + job->len + 1, dir, WSZ(len) );
+    memcpy( job->names + job->len + 1 + len, fd->cFileName, WSZ(flen + 1) );
+    // The editor only needs waking when the list was empty.
+    if (job->len == 0)
+      SetEvent( job->ready );
+    job->len += len + flen + 2;
+    ++job->found;
+  }
+  LeaveCriticalSection( &job->cs );
+
+  return more;
+}
+
+
+// Search the components of a recursive search, using a walker on this thread
+// and more on their own threads.
+void walk( PFindJob job )
+{
+  Walk	 w;
+  HANDLE thread[WALKERS];
+  int	 threads, j;
+  SYSTEM_INFO si;
+
+  GetSystemInfo( &si );
+  w.walkers = (si.dwNumberOfProcessors < WALKERS) ? si.dwNumberOfProcessors
+						  : WALKERS;
+  if (w.walkers < 2)
+    w.walkers = 2;		// still worth it for waiting on the disk
+  w.queue = calloc( w.walkers, sizeof(WalkQueue) );
+  if (!w.queue)
+    return;
+  for (j = 0; j < w.walkers; ++j)
+    InitializeCriticalSection( &w.queue[j].cs );
+  w.job = job;
+  w.next_id = 0;
+  w.pending = 0;
+  w.done = FALSE;
+  w.work = CreateSemaphore( NULL, 0, 0x7FFFFFFF, NULL );
+
+  if (w.work && walk_push( &w, 0, L"", 0, NULL, 0, 0 ))
+  {
+    threads = 0;
+    for (j = 1; j < w.walkers; ++j)
+    {
+      thread[threads] = CreateThread( NULL, 0, walker, &w, 0, NULL );
+      if (thread[threads])
+	++threads;
+    }
+    walker( &w );
+    if (threads)
+    {
+      WaitForMultipleObjects( threads, thread, TRUE, INFINITE );
+      while (--threads >= 0)
+	CloseHandle( thread[threads] );
+    }
+  }
+
+  for (j = 0; j < w.walkers; ++j)
+  {
+    while (w.queue[j].top < w.queue[j].bottom)
+      free( w.queue[j].dir[w.queue[j].top++].dir );
+    free( w.queue[j].dir );
+    DeleteCriticalSection( &w.queue[j].cs );
+  }
+  free( w.queue );
+  if (w.work)
+    CloseHandle( w.work );
+}
+
+
+// Search directories until there are none left (or enough names have been
+// found), taking them from the other walkers when our own queue is empty.
+// Each queued directory releases the semaphore once, so waiting on it means
+// there's one to pop; when the search finishes, every walker is released.
+DWORD WINAPI walker( LPVOID param )
+{
+  PWalk   w = param;
+  WalkDir d;
+  int	  id;
+
+  id = (InterlockedIncrement( &w->next_id ) - 1) % w->walkers;
+  for (;;)
+  {
+    WaitForSingleObject( w->work, INFINITE );
+    if (w->done)
+      break;
+    if (w->job->cancel || w->job->found >= WALK_NAMES)
+    {
+      w->done = TRUE;
+      ReleaseSemaphore( w->work, w->walkers, NULL );
+      break;
+    }
+    if (walk_pop( w, id, &d ))
+    {
+      walk_dir( w, id, &d );
+      free( d.dir );
+      if (InterlockedDecrement( &w->pending ) == 0)
+      {
+	w->done = TRUE;		// nothing queued and nothing being searched
+	ReleaseSemaphore( w->work, w->walkers, NULL );
+      }
+    }
+  }
+  return 0;
+}
+
+
+// Add the directory dir (of length len) plus name (if not NULL) to walker
+// id's queue, to match component comp.  Returns FALSE if there's no memory.
+BOOL walk_push( PWalk w, int id, PCWSTR dir, DWORD len, PCWSTR name,
+		int comp, int depth )
+{
+  PWalkQueue q = &w->queue[id];
+  PWalkDir   d;
+  DWORD      nlen;
+
+  nlen = (name) ? wcslen( name ) + 1 : 0;
+  EnterCriticalSection( &q->cs );
+  if (q->bottom == q->max)
+  {
+    if (q->top)
+    {
+      memmove( q->dir, q->dir + q->top, (q->bottom - q->top) * sizeof(WalkDir) );
+      q->bottom -= q->top;
+      q->top = 0;
+    }
+    else
+    {
+      d = realloc( q->dir, (q->max + 64) * sizeof(WalkDir) );
+      if (!d)
+      {
+	LeaveCriticalSection( &q->cs );
+	return FALSE;
+      }
+      q->dir  = d;
+      q->max += 64;
+    }
+  }
+  d = &q->dir[q->bottom];
+  d->dir = malloc( WSZ(len + nlen + 1) );
+  if (!d->dir)
+  {
+    LeaveCriticalSection( &q->cs );
+    return FALSE;
+  }
+  memcpy( d->dir, dir, WSZ(len) );
+  if (name)
+  {
+    memcpy( d->dir + len, name, WSZ(nlen - 1) );
+    d->dir[len + nlen - 1] = w->job->sep;
+  }
+  d->len = len + nlen;
+  d->dir[d->len] = '\0';
+  d->comp  = comp;
+  d->depth = depth;
+  ++q->bottom;
+  InterlockedIncrement( &w->pending );
+  LeaveCriticalSection( &q->cs );
+  ReleaseSemaphore( w->work, 1, NULL );
+
+  return TRUE;
+}
+
+
+// Get a directory from walker id's own queue (the most recent, to keep the
+// search going deeper) or from the others (the oldest, which will probably
+// have more beneath it).  Returns FALSE if there's nothing to be had.
+BOOL walk_pop( PWalk w, int id, PWalkDir d )
+{
+  PWalkQueue q;
+  BOOL	     got;
+  int	     j;
+
+  q = &w->queue[id];
+  EnterCriticalSection( &q->cs );
+  got = (q->top < q->bottom);
+  if (got)
+    *d = q->dir[--q->bottom];
+  LeaveCriticalSection( &q->cs );
+
+  for (j = 1; !got && j < w->walkers; ++j)
+  {
+    q = &w->queue[(id + j) % w->walkers];
+    EnterCriticalSection( &q->cs );
+    got = (q->top < q->bottom);
+    if (got)
+      *d = q->dir[q->top++];
+    LeaveCriticalSection( &q->cs );
+  }
+
+  return got;
+}
+
+
+// Search one directory, matching its component.  "**" matches nothing (so
+// try the next component here), as well as every subdirectory (so try this
+// component again in each one).  The last component provides the names.
+void walk_dir( PWalk w, int id, PWalkDir d )
+{
+  PFindJob job = w->job;
+  HANDLE   fh;
+  WIN32_FIND_DATA fd;
+  WCHAR    spec[MAX_PATH];
+  PCWSTR   comp;
+  BOOL	   all, last, match;
+
+  comp = job->comp[d->comp];
+  all  = (comp[0] == '*' && comp[1] == '*' && comp[2] == '\0');
+  last = (d->comp == job->comps - 1);
+  if (job->dirlen + d->len + wcslen( comp ) >= MAX_PATH)
+    return;
+  memcpy( spec, job->spec, WSZ(job->dirlen) );
+  memcpy( spec + job->dirlen, d->dir, WSZ(d->len) );
+
+  if (all)
+  {
+    if (!last)
+      walk_push( w, id, d->dir, d->len, NULL, d->comp + 1, d->depth );
+    comp = L"*";
+  }
+  wcscpy( spec + job->dirlen + d->len, comp );
+
+  if (last)
+  {
+    match = match_file( job, spec, job->dirlen + d->len, TRUE, &fh, &fd );
+    while (match)
+    {
+      if (!add_name( job, d->dir, d->len, &fd ))
+      {
+	FindClose( fh );
+	return;
+      }
+      if (all && (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+	  !(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+	  d->depth < WALK_DEPTH)
+	walk_push( w, id, d->dir, d->len, fd.cFileName, d->comp, d->depth+1 );
+      match = match_file( job, spec, job->dirlen + d->len, FALSE, &fh, &fd );
+    }
+    return;
+  }
+
+  // No wildcards, so no need to search for it.
+  if (!wcspbrk( comp, L"*?" ))
+  {
+    if (d->depth < WALK_DEPTH)
+      walk_push( w, id, d->dir, d->len, comp, d->comp + 1, d->depth + 1 );
+    return;
+  }
+
+  fh = FindFirstFile( spec, &fd );
+  if (fh == INVALID_HANDLE_VALUE)
+    return;
+  do
+  {
+    if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+	(fd.cFileName[0] == '.' &&
+	 (fd.cFileName[1] == '\0' ||
+	  (fd.cFileName[1] == '.' && fd.cFileName[2] == '\0'))))
+      continue;
+    // Don't follow junctions down an unknown number of directories.
+    if (all && (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+      continue;
+    if (d->depth < WALK_DEPTH)
+      walk_push( w, id, d->dir, d->len, fd.cFileName,
+		 (all) ? d->comp : d->comp + 1, d->depth + 1 );
+  } while (!job->cancel && FindNextFile( fh, &fd ));
+  FindClose( fh );
+}
+
+
+// Release one owner of the job, freeing it if it was the last.
+void release_job( PFindJob job )
+{
+  if (InterlockedDecrement( &job->refs ) == 0)
+  {
+    CloseHandle( job->ready );
+    DeleteCriticalSection( &job->cs );
+    free( job->names );
+    free( job->spec );
+    free( job->ext );
+    free( job->assoc );
+    reset_exts( &job->exts );
+    free( job->comp );
+    free( job );
+  }
+}
+
+
+// Determine if a key has been pressed, discarding the events get_key would
+// ignore (so the console handle doesn't remain signalled).
+BOOL key_pending( void )
+{
+  INPUT_RECORD rec;
+  DWORD        read;
+
+  while (PeekConsoleInput( hConIn, &rec, 1, &read ) && read)
+  {
+    if (rec.EventType == KEY_EVENT && rec.Event.KeyEvent.bKeyDown &&
+	VK != VK_SHIFT && VK != VK_CONTROL && VK != VK_MENU)
+      return TRUE;
+    ReadConsoleInput( hConIn, &rec, 1, &read );
+  }
+  return FALSE;
+}
+
+
+// Put the full path of the directory in spec (of length len) into dir,
+// ending with a backslash.  Returns its length, or 0 if it's too long.
+DWORD full_dir( PCWSTR spec, DWORD len, PWSTR dir )
+{
+  WCHAR path[MAX_PATH];
+
+  if (len == 0)
+    len = GetCurrentDirectory( MAX_PATH - 1, dir );
+  else
+  {
+    if (len >= MAX_PATH)
+      return 0;
+    memcpy( path, spec, WSZ(len) );
+    path[len] = '\0';
+    len = GetFullPathName( path, MAX_PATH - 1, dir, NULL );
+  }
+  if (len == 0 || len >= MAX_PATH - 1)
+    return 0;
+  if (dir[len-1] != '\\')
+    dir[len++] = '\\';
+  dir[len] = '\0';
+
+  return len;
+}
+
+
+// Determine if the directory dir (of length len), or one of its parents, has
+// recently failed.
+BOOL is_bad_path( PCWSTR dir, DWORD len )
+{
+  DWORD now;
+  int	j;
+
+  now = GetTickCount();
+  for (j = 0; j < BAD_PATHS; ++j)
+  {
+    if (bad_path[j].path && (int)(bad_path[j].expires - now) > 0 &&
+	bad_path[j].len <= len &&
+	_wcsnicmp( bad_path[j].path, dir, bad_path[j].len ) == 0)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+// Determine if FindFirstFile failed because the path itself couldn't be
+// reached, rather than because nothing matched.
+BOOL unreachable( DWORD error )
+{
+  switch (error)
+  {
+    case ERROR_PATH_NOT_FOUND:
+    case ERROR_BAD_NETPATH:
+    case ERROR_BAD_NET_NAME:
+    case ERROR_SEM_TIMEOUT:
+    case ERROR_NETWORK_UNREACHABLE:
+    case ERROR_HOST_UNREACHABLE:
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+// Remember the directory dir (of length len) as bad, replacing the entry
+// that expires first.
+void add_bad_path( PCWSTR dir, DWORD len )
+{
+  int	j, old;
+  PWSTR p;
+
+  old = 0;
+  for (j = 0; j < BAD_PATHS; ++j)
+  {
+    if (!bad_path[j].path ||
+	(bad_path[j].len == len && _wcsnicmp( bad_path[j].path, dir, len ) == 0))
+    {
+      old = j;
+      break;
+    }
+    if ((int)(bad_path[j].expires - bad_path[old].expires) < 0)
+      old = j;
+  }
+
+  p = new_txt( dir, len );
+  if (p)
+  {
+    free( bad_path[old].path );
+    bad_path[old].path	  = p;
+    bad_path[old].len	  = len;
+    bad_path[old].expires = GetTickCount() + BAD_PATH_TTL;
+  }
+}
+
+
 // The first time the open dialog is used it puts the window behind all other
 // console windows (seems to be something to do with ReadConsoleInput).  Use
 // the hook to move it back to the front.
@@ -2858,41 +4253,35 @@ UINT_PTR CALLBACK OpenHook( HWND dlg, UINT msg, WPARAM wParam, LPARAM lParam )
 
 // Find the files matching the path up to pos.	If dirs is TRUE only find
 // directories; if -1, use the open dialog.  Returns -1 if no files matched;
-// -2 if wildcards were explicitly given; otherwise the length of the
-// portion common to all files; the dialog returns TRUE if any files were
-// selected, FALSE otherwise.  path_pos is set to the start of the path (if
-// found_quote is TRUE there is a quote before it); fname_pos to the start
-// of the filename; fname_cnt has the number of matching files; and
-// fname_max is the length of the longest.
+// -2 if wildcards were explicitly given; -3 if a key was pressed before all
+// the files were found; otherwise the length of the portion common to all
+// files; the dialog returns TRUE if any files were selected, FALSE otherwise.
+// path_pos is set to the start of the path (if found_quote is TRUE there is a
+// quote before it); fname_pos to the start of the filename; fname_cnt has the
+// number of matching files; and fname_max is the length of the longest.
 int find_files( int* pos, int dirs )
 {
-  HANDLE   fh;
   WIN32_FIND_DATA fd;
   OPENFILENAME ofn;
-  PHistory f, p;
-  int	   beg, start;
-  DWORD    end, dend;
-  BOOL	   wild, exe;
+  FName    f;
+  PFindJob job;
+  HANDLE   wait[2];
+  PWSTR    names, nm;
+  int	   beg, start, base;
+  DWORD    end, flen, dend, dlen, len;
+  DWORD    started, timeout, wait_rc;
+  BOOL	   wild, exe, found, deep;
   WCHAR    wch[2];
   int	   prefix;
-  DWORD    extlen;
   BOOL	   match;
   DWORD    quote;
   WCHAR    dir[MAX_PATH];
   static int openinit = FALSE;
+  LONGLONG timed = lat_now();
 
-  // Free the names from the previous completion.
-  if (fname)
-  {
-    f = fname;
-    do
-    {
-      p = f->next;
-      free( f );
-      f = p;
-    } while (f != fname);
-    fname = NULL;
-  }
+  // Forget the names from the previous completion.
+  fname_used = 0;
+  fname_cnt  = 0;
 
   // Find the start of the path - either the first non-terminated quote or
   // an appropriate delimiter.
@@ -2932,13 +4321,20 @@ int find_files( int* pos, int dirs )
   exe = (path_pos == start + found_quote);
 
   // Now find the filename position within the path and check for wildcards.
+  // Wildcards in a directory make it a recursive search, with the names
+  // relative to the directory before it.
   wild = FALSE;
-  for (fname_pos = beg = path_pos; beg < *pos; ++beg)
+  for (fname_pos = base = beg = path_pos; beg < *pos; ++beg)
   {
     switch (line.txt[beg])
     {
-      case '*' :                                // assume they're in the name
-      case '?' : wild = TRUE; break;
+      case '*' :
+      case '?' : if (!wild)
+		 {
+		   wild = TRUE;
+		   base = fname_pos;
+		 }
+		 break;
       case '/' :
       case '\\': dirchar   = line.txt[beg];     // use the same separator
       case ':' : fname_pos = beg + 1;
@@ -2950,12 +4346,9 @@ int find_files( int* pos, int dirs )
   wch[0] = line.txt[*pos];
   wch[1] = line.txt[*pos+1];
   if (wild)
-    line.txt[*pos] = '\0';
+    put_char( *pos, '\0' );
   else
-  {
-    line.txt[*pos]   = '*';
-    line.txt[*pos+1] = '\0';
-  }
+    put_chars( *pos, L"*", 2 );
 
   if (dirs < 0)
   {
@@ -2995,97 +4388,296 @@ int find_files( int* pos, int dirs )
   }
   else
   {
-    // Store the original completion name as the first entry.
-    fname = new_history( line.txt + fname_pos, *pos - fname_pos );
-    if (!fname)
-      return -1;
-    fname->next = fname->prev = fname;
+    deep = (wild && base != fname_pos);
+    if (deep)
+      fname_pos = base;
 
-    if (exe)
-    {
-      extlen = get_env_var( L"FEXEC", NULL );
-      if (extlen == 0)
-	extlen = get_env_var( L"PATHEXT", FEXEC );
-    }
-    else
-      extlen = get_env_var( L"FIGNORE", FIGNORE );
+    // Don't bother trying a path that has recently failed.
+    prefix = -1;
+    dlen = full_dir( line.txt + path_pos, fname_pos - path_pos, dir );
+    if (dlen && is_bad_path( dir, dlen ))
+      goto done;
 
-    match = match_file( line.txt+path_pos, envvar.txt, extlen, dirs, exe,
-			&fh, &fd );
-    // If nothing was found try again without the ignore list.
-    if (!match && !exe && !dirs)
-      match = match_file( line.txt+path_pos, NULL, extlen = 0, FALSE, FALSE,
-			  &fh, &fd );
-    prefix = (!match || !wild) ? -1 : -2;
-    fname_max = fname_cnt = 0;
-    while (match)
+    // Store the original completion name as the first entry.
+    if (!add_fname( 0, line.txt + fname_pos, *pos - fname_pos, 0, 0 ))
+      goto done;
+
+    job = start_find( *pos, dirs, exe, deep );
+    if (!job)
+      goto done;
+
+    // Merge the names as they arrive.  A key press abandons the search
+    // (leaving the key for the editor); the worker will finish by itself.
+    // Give up if the directory can't even be opened in time (the path is
+    // probably unreachable).
+    wait[0] = job->ready;
+    wait[1] = hConIn;
+    fname_max = 0;
+    found = FALSE;
+    started = GetTickCount();
+    for (;;)
     {
-      if (!wild)
-      {
-	// Ensure the name matches what was typed, to overcome Windows foibles
-	// (like "file." matching "file" and ".f" matching "f").
-	if (_wcsnicmp( fd.cFileName, line.txt+fname_pos, *pos-fname_pos ) != 0)
-	  goto next;
-      }
-
-      ++fname_cnt;
-      end = wcslen( fd.cFileName );
-      if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-	fd.cFileName[end++] = dirchar;
-      dend = display_length( fd.cFileName, 0, end );
-      if (dend > fname_max)
-	fname_max = dend;
-      f = new_history( fd.cFileName, end );
-      if (!f)
-	return -1;
-      f->dlen = dend;
-
-      if (!wild)
+      EnterCriticalSection( &job->cs );
+      names = job->names;
+      len   = job->len;
+      match = job->done;
+      job->names = NULL;
+      job->len = job->max = 0;
+      LeaveCriticalSection( &job->cs );
+      if (len)
+	found = TRUE;
+
+      for (nm = names; nm < names + len; nm += end + 2)
       {
-	// Find the portion common to all the names.
-	if (prefix < 0)
-	  prefix = end;
-	else
+	end = wcslen( nm + 1 );
+	if (!wild)
 	{
-	  for (beg = 0; beg < prefix; ++beg)
-	    if (towlower( f->line[beg] ) != towlower( fname->next->line[beg] ))
-	      break;
-	  prefix = beg;
+	  // Ensure the name matches what was typed, to overcome Windows foibles
+	  // (like "file." matching "file" and ".f" matching "f").
+	  if (_wcsnicmp( nm + 1, line.txt+fname_pos, *pos-fname_pos ) != 0)
+	    continue;
 	}
-      }
 
-      // Find where to insert the new name to sort the list.  Work backwards,
-      // since NTFS maintains a sorted list, anyway.
-      for (p = fname->prev; p != fname; p = p->prev)
-      {
-	if (CompareString( LOCALE_USER_DEFAULT, NORM_IGNORECASE,
-			   f->line, f->flen,
-			   p->line, p->flen ) == CSTR_GREATER_THAN)
-	  break;
+	flen = end;
+	if (*nm == 'd')
+	  nm[1 + flen++] = dirchar;
+	dend = display_length( nm + 1, 0, flen );
+	if (!add_fname( fname_cnt + 1, nm + 1, flen, dend,
+			(*nm == 'd') ? FILE_ATTRIBUTE_DIRECTORY : 0 ))
+	  continue;
+	f = fname[++fname_cnt];
+	if (dend > fname_max)
+	  fname_max = dend;
+
+	if (!wild)
+	{
+	  // Find the portion common to all the names.
+	  if (prefix < 0)
+	    prefix = f.flen;
+	  else
+	  {
+	    for (beg = 0; beg < prefix; ++beg)
+	      if (towlower( fname_pool[f.ofs+beg] ) != towlower( FNAME(1)[beg] ))
+		break;
+	    prefix = beg;
+	  }
+	}
+      }
+      free( names );
+
+      if (match)
+      {
+	// Remember a path that was slow to fail (like a dead share), but
+	// not one that merely had no matches.  A recursive search is slow
+	// anyway, so only its own directory is ever tried.
+	if (!found && dlen && !deep && unreachable( job->error ) &&
+	    GetTickCount() - started >= FIND_SLOW)
+	  add_bad_path( dir, dlen );
+	break;
+      }
+      timeout = INFINITE;
+      if (!job->opened)
+      {
+	timeout = GetTickCount() - started;
+	timeout = (timeout >= FIND_TIMEOUT) ? 0 : FIND_TIMEOUT - timeout;
+      }
+      wait_rc = WaitForMultipleObjects( 2, wait, FALSE, timeout );
+      if (wait_rc == WAIT_TIMEOUT)
+      {
+	InterlockedExchange( &job->cancel, TRUE );
+	if (dlen && !deep)
+	  add_bad_path( dir, dlen );
+	break;
       }
-      f->prev = p;
-      f->next = p->next;
-      p->next->prev = f;
-      p->next = f;
+      if (wait_rc == WAIT_OBJECT_0 + 1 && key_pending())
+      {
+	InterlockedExchange( &job->cancel, TRUE );
+	prefix = -3;
+	break;
+      }
+    }
+    release_job( job );
+
+    // Sort the names once they're all in (the original stays first).
+    if (prefix != -3 && fname_cnt > 1)
+      qsort( fname + 1, fname_cnt, sizeof(FName), fname_cmp );
 
-    next:
-      match = match_file( NULL, envvar.txt, extlen, dirs, exe, &fh, &fd );
+    if (prefix != -3)
+    {
+      if (fname_cnt == 0)
+	prefix = -1;
+      else if (wild)
+	prefix = -2;
     }
   }
 
-  line.txt[*pos]   = wch[0];
-  line.txt[*pos+1] = wch[1];
+done:
+  put_chars( *pos, wch, 2 );
+
+  // Don't count the time spent in the file dialog.
+  if (dirs != -1)
+    lat_add( lat_extra + LAT_FIND, timed );
 
   return prefix;
 }
 
 
+// Create the job to find the names matching the path up to pos and start its
+// thread.  If deep is TRUE, the name is a path to search recursively.	Returns
+// NULL if there's no memory for it.
+PFindJob start_find( DWORD pos, int dirs, BOOL exe, BOOL deep )
+{
+  PFindJob job;
+  PDefine  a;
+  HANDLE   thread;
+  DWORD    size;
+  PWSTR    p;
+
+  job = calloc( 1, sizeof(FindJob) );
+  if (!job)
+    return NULL;
+  job->refs = 2;
+  job->dirs = dirs;
+  job->exe  = exe;
+  job->sep  = dirchar;
+  job->dirlen = fname_pos - path_pos;
+  job->spec = new_txt( line.txt + path_pos, wcslen( line.txt + path_pos ) + 1 );
+
+  // Split the name into its components (in place, after the base path),
+  // treating consecutive "**" as one.
+  if (deep && job->spec)
+  {
+    for (size = 1, p = job->spec + job->dirlen; *p; ++p)
+      if (*p == '\\' || *p == '/')
+	++size;
+    job->comp = malloc( size * sizeof(PWSTR) );
+    if (!job->comp)
+    {
+      free( job->spec );
+      job->spec = NULL;
+    }
+    else
+    {
+      p = job->spec + job->dirlen;
+      while (*p)
+      {
+	job->comp[job->comps] = p;
+	while (*p && *p != '\\' && *p != '/')
+	  ++p;
+	if (*p)
+	  *p++ = '\0';
+	if (*job->comp[job->comps] &&
+	    !(job->comps && wcscmp( job->comp[job->comps], L"**" ) == 0 &&
+			    wcscmp( job->comp[job->comps-1], L"**" ) == 0))
+	  ++job->comps;
+      }
+      // A trailing separator (empty last component) would match nothing.
+      if (job->comps == 0)
+	job->comp[job->comps++] = L"*";
+    }
+  }
+
+  if (exe)
+  {
+    job->extlen = get_env_var( L"FEXEC", NULL );
+    if (job->extlen == 0)
+      job->extlen = get_env_var( L"PATHEXT", FEXEC );
+
+    // Associations can change while the worker is still running (if it's
+    // been abandoned), so it gets its own copy of the extensions.
+    size = 0;
+    for (a = assocs.head; a; a = a->next)
+    {
+      if (!make_length( &job->assoc, &size, job->assoclen + a->len + 1 ))
+	break;
+      memcpy( job->assoc + job->assoclen, a->name, WSZ(a->len) );
+      job->assoclen += a->len;
+      job->assoc[job->assoclen++] = ';';
+    }
+  }
+  else if (!deep)
+    job->extlen = get_env_var( L"FIGNORE", FIGNORE );
+  if (job->extlen)
+    job->ext = new_txt( envvar.txt, job->extlen );
+  if (exe && (job->ext || job->extlen == 0))
+  {
+    // If there's not enough memory, matching falls back to the lists.
+    if (!index_exts( &job->exts, NULL, job->ext, job->extlen ) ||
+	!index_exts( &job->exts, NULL, job->assoc, job->assoclen ))
+      reset_exts( &job->exts );
+  }
+
+  job->ready = CreateEvent( NULL, FALSE, FALSE, NULL );
+  if (!job->spec || (job->extlen && !job->ext) || !job->ready)
+  {
+    if (job->ready)
+      CloseHandle( job->ready );
+    free( job->spec );
+    free( job->ext );
+    free( job->assoc );
+    reset_exts( &job->exts );
+    free( job->comp );
+    free( job );
+    return NULL;
+  }
+  InitializeCriticalSection( &job->cs );
+
+  thread = CreateThread( NULL, 0, find_worker, job, 0, NULL );
+  if (thread)
+    CloseHandle( thread );
+  else
+    find_worker( job );		// no thread, so just do it now
+
+  return job;
+}
+
+
+// Store the name (of length len, displaying in dlen cells) as entry n.
+// Returns FALSE if there's no memory for it.
+// Compare two names for qsort, ignoring case.
+int fname_cmp( const void* a, const void* b )
+{
+  const FName* fa = a;
+  const FName* fb = b;
+
+  return CompareString( LOCALE_USER_DEFAULT, NORM_IGNORECASE,
+			fname_pool + fa->ofs, fa->flen,
+			fname_pool + fb->ofs, fb->flen ) - CSTR_EQUAL;
+}
+
+
+BOOL add_fname( int n, PCWSTR name, DWORD len, DWORD dlen, DWORD attrs )
+{
+  PFName f;
+
+  if (n >= fname_size)
+  {
+    f = realloc( fname, (fname_size + 256) * sizeof(FName) );
+    if (!f)
+      return FALSE;
+    fname = f;
+    fname_size += 256;
+  }
+  if (!make_length( &fname_pool, &fname_room, fname_used + len ))
+    return FALSE;
+
+  memcpy( fname_pool + fname_used, name, WSZ(len) );
+  fname[n].ofs	 = fname_used;
+  fname[n].flen  = (WORD)len;
+  fname[n].dlen  = (WORD)dlen;
+  fname[n].attrs = attrs;
+  fname_used += len;
+
+  return TRUE;
+}
+
+
 // List all the files found by the completion.	If there are too many lines for
 // the buffer, refuse to list any; prompt if there are too many for the window.
 // Assumes more than one name.
 void list_files( void )
 {
-  PHistory f;
+  int	   f;
   int	   lines, row, next_col;
   CONSOLE_SCREEN_BUFFER_INFO csbi;
 
@@ -3099,10 +4691,10 @@ void list_files( void )
   {
     if (check_name_count( fname_cnt ))
     {
-      for (f = fname->next; f != fname; f = f->next)
+      for (f = 1; f <= fname_cnt; ++f)
       {
-	WriteCon( hConOut, f->line, f->flen );
-	if (f->dlen % screen.dwSize.X)
+	WriteCon( hConOut, FNAME(f), fname[f].flen );
+	if (fname[f].dlen % screen.dwSize.X)
 	  WriteCon( hConOut, L"\n", 1 );
       }
     }
@@ -3114,10 +4706,10 @@ void list_files( void )
       SetConsoleMode( hConOut, ENABLE_PROCESSED_OUTPUT ); // don't wrap at EOL
       GetConsoleScreenBufferInfo( hConOut, &screen );
       row = next_col = 0;
-      for (f = fname->next; f != fname; f = f->next)
+      for (f = 1; f <= fname_cnt; ++f)
       {
 	SetConsoleCursorPosition( hConOut, screen.dwCursorPosition );
-	WriteCon( hConOut, f->line, f->flen );
+	WriteCon( hConOut, FNAME(f), fname[f].flen );
 	GetConsoleScreenBufferInfo( hConOut, &csbi );
 	if (csbi.dwCursorPosition.X > next_col)
 	  next_col = csbi.dwCursorPosition.X;
@@ -3155,7 +4747,7 @@ int calc_lines( void )
 {
   int	   lines, line, cols, col;
   DWORD    max;
-  PHistory f;
+  PFName   f;
 
   cols = screen.dwSize.X / fname_max;
   if ((cols - 1) * 2 > screen.dwSize.X % fname_max)
@@ -3171,7 +4763,7 @@ int calc_lines( void )
     if (--lines == 0)
       return 1;
     col = line = max = 0;
-    for (f = fname->next; f != fname; f = f->next)
+    for (f = fname + 1; f <= fname + fname_cnt; ++f)
     {
       if (f->dlen > max)
       {
@@ -3179,193 +4771,714 @@ int calc_lines( void )
 	  return lines + 1;
 	max = f->dlen;
       }
-      if (++line == lines)
+      if (++line == lines)
+      {
+	col += max + 2;
+	line = max = 0;
+      }
+    }
+  }
+}
+
+
+// Return TRUE if the names should be displayed, FALSE if not.
+BOOL check_name_count( int lines )
+{
+  Key yn;
+
+  if (lines > screen.dwSize.Y - 2)
+  {
+    wprintf( L"Too many names to display (%d)!\n", fname_cnt );
+    return FALSE;
+  }
+
+  if (lines > screen.srWindow.Bottom - screen.srWindow.Top - 1)
+  {
+    wprintf( L"Display all %d possibilities? ", fname_cnt );
+    get_key( &yn );
+    if (yn.ch == 'y' || yn.ch == 'Y')
+    {
+      _putws( L"Yes" );
+      return TRUE;
+    }
+    _putws( L"No" );
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+// Return TRUE if str should be quoted.
+BOOL quote_needed( PCWSTR str, int cnt )
+{
+  while (--cnt >= 0)
+    if (wcschr( QUOTE_FNAME, str[cnt] ))
+      return TRUE;
+
+  return FALSE;
+}
+
+
+// Make a filter string for the open dialog.
+PWSTR make_filter( BOOL exe )
+{
+  PWSTR f;
+  WCHAR buf[2048];
+  int	len, extlen;
+
+  *buf = '\0';
+  len = wcslen( line.txt+fname_pos );
+  if (exe && line.txt[fname_pos+len-1] == '*')
+  {
+    extlen = get_env_var( L"FEXEC", NULL );
+    if (extlen == 0)
+      extlen = get_env_var( L"PATHEXT", FEXEC );
+    if (extlen)
+    {
+      PWSTR e = envvar.txt;
+      int   d = 0, cnt = lenof(buf), sz;
+      f = buf;
+      while (*e)
+      {
+	while (e[++d] != '.' && e[d] != ';' && e[d] != ':' && e[d] != '\0') ;
+	sz = _snwprintf( f, cnt, L"%s%.*s;", line.txt+fname_pos, d, e );
+	f += sz;
+	cnt -= sz;
+	if (e[d] == ';' || e[d] == ':')
+	  ++d;
+	e += d;
+	d = 0;
+      }
+      f[-1] = '\0';
+    }
+  }
+  if (!*buf)
+    wcscpy( buf, line.txt+fname_pos );
+
+  len += 1 + wcslen( buf ) + 1 + 13;
+  f = malloc( WSZ(len) );
+  if (f)
+  {
+    _snwprintf( f, len, L"%s%c%s%cAll files%c*%c",
+		line.txt+fname_pos, 0, buf, 0, 0, 0 );
+  }
+  return f;
+}
+
+
+// Make an absolute path a relative path and ensure it ends with a backslash.
+// If path starts with the current directory remove that portion.  If the cwd
+// is one or two levels below path, use the shortcuts.	Otherwise keep the
+// complete path.
+void make_relative( PWSTR path, PWSTR rel )
+{
+  WCHAR buf[MAX_PATH];
+  PWSTR cwd = buf, dir, root;
+
+  GetCurrentDirectory( MAX_PATH, cwd );
+  if (*cwd == *path)
+  {
+    *rel = '\0';
+  }
+  else
+  {
+    rel[0] = *path;
+    rel[1] = ':';
+    rel[2] = '\0';
+    GetFullPathName( rel, MAX_PATH, cwd, NULL );
+    rel += 2;
+  }
+  cwd  += 2;
+  path += 2;
+  root	= path;
+
+  // Root current directory is always relative.
+  if (cwd[1] == '\0')
+  {
+    if (*path != '\0')
+    {
+      wcscpy( rel, path+1 );
+      wcscat( rel, L"\\" );
+    }
+    return;
+  }
+
+  // Root path is always absolute.
+  if (*path == '\0')
+  {
+    wcscat( rel, L"\\" );
+    return;
+  }
+
+  // Skip over the common directories.
+  dir = cwd;
+  while (*++path == *++cwd && *path)
+  {
+    if (*cwd == '\\')
+      dir = cwd;
+  }
+
+  // In the current directory.
+  if (*cwd == '\0' && *path == '\0')
+    return;
+
+  // Below the current directory.
+  if (*cwd == '\0' && *path == '\\')
+  {
+    root = path + 1;
+  }
+  else
+  {
+    if (*cwd == '\\' && *path == '\0')
+      dir = cwd;
+    else
+      path -= cwd - dir;
+
+    // One level above, use parent shortcut.
+    dir = wcschr( dir+1, '\\' );
+    if (dir == NULL)
+    {
+      wcscpy( rel, L".." );
+      rel += 2;
+      root = path;
+    }
+    else
+    {
+      // Two levels above, use two parent shortcuts.
+      dir = wcschr( dir+1, '\\' );
+      if (dir == NULL)
+      {
+	wcscpy( rel, L"..\\.." );
+	rel += 5;
+	root = path;
+      }
+    }
+  }
+
+  wcscpy( rel, root );
+  wcscat( rel, L"\\" );
+}
+
+
+// ---------------------------   Config Cache   ------------------------------
+
+
+// Hash size bytes of mem (FNV-1a).
+DWORD hash_bytes( const void* mem, DWORD size )
+{
+  const BYTE* p = mem;
+  DWORD h = 2166136261u;
+
+  while (size-- > 0)
+  {
+    h ^= *p++;
+    h *= 16777619;
+  }
+
+  return h;
+}
+
+
+// Read an entire file in one go, setting its size and, if time isn't NULL,
+// its last write time.  Returns the contents (to be freed), or NULL.
+PBYTE read_whole( PCWSTR name, LPDWORD size, FILETIME* time )
+{
+  HANDLE h;
+  PBYTE  buf;
+  DWORD  got;
+
+  h = CreateFile( name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		  OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+  if (h == INVALID_HANDLE_VALUE)
+    return NULL;
+
+  buf = NULL;
+  *size = GetFileSize( h, NULL );
+  if (*size != INVALID_FILE_SIZE &&
+      (time == NULL || GetFileTime( h, NULL, NULL, time )))
+  {
+    buf = malloc( *size + 1 );
+    if (buf && (!ReadFile( h, buf, *size, &got, NULL ) || got != *size))
+    {
+      free( buf );
+      buf = NULL;
+    }
+  }
+  CloseHandle( h );
+
+  return buf;
+}
+
+
+// Find the first line of the configuration starting with '#', returning its
+// position and setting num to its line number (or 0 if there isn't one).
+DWORD first_section( PBYTE cfg, DWORD size, LPDWORD num )
+{
+  PBYTE nl;
+  DWORD pos, n;
+
+  pos = (size >= 3 && memcmp( cfg, "\xEF\xBB\xBF", 3 ) == 0) ? 3 : 0;
+  for (n = 1; pos < size; ++n)
+  {
+    if (cfg[pos] == '#')
+    {
+      *num = n;
+      return pos;
+    }
+    nl = memchr( cfg + pos, '\n', size - pos );
+    if (nl == NULL)
+      break;
+    pos = nl - cfg + 1;
+  }
+
+  *num = 0;
+  return 0;
+}
+
+
+// Convert a key to its position within the keymaps (in the order they are
+// cached) and back again.
+DWORD key_offset( char* key )
+{
+  if (key >= *ctrl_key_table && key < *ctrl_key_table + sizeof(ctrl_key_table))
+    return key - *ctrl_key_table + sizeof(key_table) + sizeof(fkey_table);
+  if (key >= *fkey_table && key < *fkey_table + sizeof(fkey_table))
+    return key - *fkey_table + sizeof(key_table);
+  return key - *key_table;
+}
+
+
+char* offset_key( DWORD ofs )
+{
+  if (ofs < sizeof(key_table))
+    return *key_table + ofs;
+  ofs -= sizeof(key_table);
+  if (ofs < sizeof(fkey_table))
+    return *fkey_table + ofs;
+  return *ctrl_key_table + ofs - sizeof(fkey_table);
+}
+
+
+// Apply the cache of the configuration, if it was made from the same file
+// with the same options.  Returns FALSE, having changed nothing, if it can't
+// be used; otherwise hdr is updated to the section for directory cwd.
+BOOL load_cache( PCWSTR cname, CacheHdr* hdr, PCWSTR cwd )
+{
+  PBYTE     buf, p;
+  DWORD     size, cnt, len, i;
+  char*     key;
+  int	    type;
+  PMacro    m;
+  PDefine   d;
+  PLineList ll;
+  Line	    save;
+
+  if (pre_cache != NULL)
+  {
+    buf = pre_cache;
+    size = pre_cache_size;
+    pre_cache = NULL;
+  }
+  else
+    buf = read_whole( cname, &size, NULL );
+  if (buf == NULL)
+    return FALSE;
+  if (size < sizeof(CacheHdr) + sizeof(DWORD) ||
+      memcmp( buf, hdr, sizeof(CacheHdr) ) != 0 ||
+      *(LPDWORD)(buf + size - sizeof(DWORD)) !=
+	hash_bytes( buf + sizeof(CacheHdr), size - sizeof(CacheHdr)
+						 - sizeof(DWORD) ) ||
+      !check_cache( buf, size, hdr->size ))
+  {
+    free( buf );
+    return FALSE;
+  }
+  p = buf + sizeof(CacheHdr);
+
+  // The definitions and history are added from the cache itself, by pointing
+  // the line at it.
+  save = line;
+  for (cnt = *(LPDWORD)p, p += 4; cnt; --cnt)
+  {
+    line.len = *(LPDWORD)p;
+    line.txt = (PWSTR)(p + 4);
+    p += 4 + WSZ(line.len);
+    add_to_history( TRUE );
+  }
+
+  memcpy( key_table, p, sizeof(key_table) );
+  p += sizeof(key_table);
+  memcpy( fkey_table, p, sizeof(fkey_table) );
+  p += sizeof(fkey_table);
+  memcpy( ctrl_key_table, p, sizeof(ctrl_key_table) );
+  p += sizeof(ctrl_key_table);
+
+  for (cnt = *(LPDWORD)p, p += 4; cnt; --cnt)
+  {
+    key  = offset_key( ((LPDWORD)p)[0] );
+    type = ((LPDWORD)p)[1];
+    len  = ((LPDWORD)p)[2];
+    p += 12;
+    m = add_macro( key );
+    if (m)
+    {
+      m->type = type;
+      m->len  = len;
+    }
+    else
+      *key = Ignore;
+    if (len == 1)
+    {
+      if (m)
+	m->chfn = *(PKey)p;
+      p += sizeof(Key);
+    }
+    else
+    {
+      size = len * ((type == MAC_FUNC) ? sizeof(Key) : sizeof(WCHAR));
+      if (m && len)
+      {
+	m->line = malloc( size );
+	if (m->line)
+	  memcpy( m->line, p, size );
+	else
+	  del_macro( key );
+      }
+      p += size;
+    }
+  }
+
+  for (i = 0; i < lenof(cache_dicts); ++i)
+  {
+    for (cnt = *(LPDWORD)p, p += 4; cnt; --cnt)
+    {
+      line.len = *(LPDWORD)p;
+      line.txt = (PWSTR)(p + 4);
+      p += 4 + WSZ(line.len);
+      d = add_define( cache_dicts[i], 0, line.len );
+      ll = NULL;
+      for (len = *(LPDWORD)p, p += 4; len; --len)
+      {
+	line.len = *(LPDWORD)p;
+	line.txt = (PWSTR)(p + 4);
+	p += 4 + WSZ(line.len);
+	if (!d)
+	  continue;
+	if (!ll)
+	  ll = d->line = add_line( 0 );
+	else
+	  ll = ll->next = add_line( 0 );
+	if (!ll)
+	{
+	  del_define( cache_dicts[i], d );
+	  d = NULL;
+	}
+      }
+      if (d && cache_dicts[i] == &assocs &&
+	  !index_exts( &assoc_exts, d, d->name, d->len ))
+      {
+	unindex_exts( &assoc_exts, d );
+	del_define( &assocs, d );
+      }
+    }
+  }
+  line = save;
+
+  // Find the section for this directory.  If the sections couldn't be
+  // indexed, they'll all be read, as usual.
+  cnt = *(LPDWORD)p;
+  p += 4;
+  if (cnt != ~0)
+  {
+    hdr->sect_line = 0;
+    len  = wcslen( cwd );
+    size = hash_name( cwd, len );
+    for (; cnt; --cnt)
+    {
+      if (((LPDWORD)p)[2] == size && ((LPDWORD)p)[3] == len &&
+	  _wcsnicmp( (PCWSTR)(p + 16), cwd, len ) == 0)
       {
-	col += max + 2;
-	line = max = 0;
+	hdr->sect	= ((LPDWORD)p)[0];
+	hdr->sect_line = ((LPDWORD)p)[1];
+	break;
       }
+      p += 16 + WSZ(((LPDWORD)p)[3]);
     }
   }
+
+  free( buf );
+  return TRUE;
 }
 
 
-// Return TRUE if the names should be displayed, FALSE if not.
-BOOL check_name_count( int lines )
+// Check that every count, length and position in the cache of size bytes at
+// buf stays within it (and the configuration of cfg_size bytes), so
+// load_cache doesn't need to.
+BOOL check_cache( PBYTE buf, DWORD size, DWORD cfg_size )
 {
-  Key yn;
+  PBYTE p, end;
+  DWORD cnt, lines, ofs, type, len, unit, i;
+  DWORD keys = sizeof(key_table) + sizeof(fkey_table) + sizeof(ctrl_key_table);
 
-  if (lines > screen.dwSize.Y - 2)
-  {
-    wprintf( L"Too many names to display (%d)!\n", fname_cnt );
+  p   = buf + sizeof(CacheHdr);
+  end = buf + size - sizeof(DWORD);	// the hash
+
+  if (!cache_dword( &p, end, &cnt ))	// history
+    return FALSE;
+  while (cnt--)
+    if (!cache_text( &p, end ))
+      return FALSE;
+
+  if (!cache_skip( &p, end, keys ))
+    return FALSE;
+
+  if (!cache_dword( &p, end, &cnt ))	// keyboard macros
     return FALSE;
+  while (cnt--)
+  {
+    if (!cache_dword( &p, end, &ofs ) || ofs >= keys ||
+	!cache_dword( &p, end, &type ) || !cache_dword( &p, end, &len ))
+      return FALSE;
+    if (len == 1)			// a single key
+      unit = sizeof(Key);
+    else
+    {
+      unit = (type == MAC_FUNC) ? sizeof(Key) : sizeof(WCHAR);
+      if (len > (DWORD)(end - p) / unit)
+	return FALSE;
+    }
+    if (!cache_skip( &p, end, len * unit ))
+      return FALSE;
   }
 
-  if (lines > screen.srWindow.Bottom - screen.srWindow.Top - 1)
+  for (i = 0; i < lenof(cache_dicts); ++i)
   {
-    wprintf( L"Display all %d possibilities? ", fname_cnt );
-    get_key( &yn );
-    if (yn.ch == 'y' || yn.ch == 'Y')
+    if (!cache_dword( &p, end, &cnt ))
+      return FALSE;
+    while (cnt--)
     {
-      _putws( L"Yes" );
-      return TRUE;
+      if (!cache_text( &p, end ) || !cache_dword( &p, end, &lines ))
+	return FALSE;
+      while (lines--)
+	if (!cache_text( &p, end ))
+	  return FALSE;
     }
-    _putws( L"No" );
+  }
+
+  if (!cache_dword( &p, end, &cnt ))	// directory sections
     return FALSE;
+  if (cnt != ~0)
+  {
+    while (cnt--)
+    {
+      if (!cache_dword( &p, end, &ofs ) || ofs >= cfg_size ||
+	  !cache_skip( &p, end, 8 ) || !cache_text( &p, end ))
+	return FALSE;
+    }
   }
 
+  return (p == end);
+}
+
+
+// Read a DWORD from the cache at p (not going past end), moving past it.
+BOOL cache_dword( PBYTE* p, PBYTE end, LPDWORD val )
+{
+  if (end - *p < 4)
+    return FALSE;
+  *val = *(LPDWORD)*p;
+  *p += 4;
   return TRUE;
 }
 
 
-// Return TRUE if str should be quoted.
-BOOL quote_needed( PCWSTR str, int cnt )
+// Move past n bytes of the cache at p, if that doesn't go past end.
+BOOL cache_skip( PBYTE* p, PBYTE end, DWORD n )
 {
-  while (--cnt >= 0)
-    if (wcschr( QUOTE_FNAME, str[cnt] ))
-      return TRUE;
+  if ((DWORD)(end - *p) < n)
+    return FALSE;
+  *p += n;
+  return TRUE;
+}
 
-  return FALSE;
+
+// Move past a length and its text.
+BOOL cache_text( PBYTE* p, PBYTE end )
+{
+  DWORD len;
+
+  return (cache_dword( p, end, &len ) &&
+	  len <= (DWORD)(end - *p) / sizeof(WCHAR) &&
+	  cache_skip( p, end, WSZ(len) ));
 }
 
 
-// Make a filter string for the open dialog.
-PWSTR make_filter( BOOL exe )
+// Write the state to the cache.  Nothing is written if there were errors or
+// anything was listed, since they would not be seen when the cache is used;
+// nor if history was reset or deleted, since the cache only adds history.
+// The cache is written to a temporary file first, so another instance never
+// sees it half-written.
+void save_cache( PCWSTR cname, const CacheHdr* hdr, PBYTE cfg )
 {
-  PWSTR f;
-  WCHAR buf[2048];
-  int	len, extlen;
+  WCHAR     tmp[MAX_PATH+lenof(CACHE_EXT)+12];
+  FILE*     out;
+  PMacro    m;
+  PDefine   d;
+  PLineList ll;
+  DWORD     cnt, i;
+  BOOL	    ok;
+
+  // The header and history were started by read_cmdfile.
+  if (seen_error || cfg_listed || cfg_unhist || !cache_ok)
+    goto done;
+
+  memcpy( cache_buf + sizeof(CacheHdr), &cache_hist, 4 );
+  put_cache( key_table, sizeof(key_table) );
+  put_cache( fkey_table, sizeof(fkey_table) );
+  put_cache( ctrl_key_table, sizeof(ctrl_key_table) );
+
+  for (cnt = 0, m = macro_head; m; m = m->next)
+    ++cnt;
+  put_cache( &cnt, 4 );
+  for (m = macro_head; m; m = m->next)
+  {
+    cnt = key_offset( m->key );
+    put_cache( &cnt, 4 );
+    put_cache( &m->type, 4 );
+    put_cache( &m->len, 4 );
+    if (m->len == 1)
+      put_cache( &m->chfn, sizeof(Key) );
+    else if (m->type == MAC_FUNC)
+      put_cache( m->func, m->len * sizeof(Key) );
+    else
+      put_cache( m->line, WSZ(m->len) );
+  }
 
-  *buf = '\0';
-  len = wcslen( line.txt+fname_pos );
-  if (exe && line.txt[fname_pos+len-1] == '*')
+  for (i = 0; i < lenof(cache_dicts); ++i)
   {
-    extlen = get_env_var( L"FEXEC", NULL );
-    if (extlen == 0)
-      extlen = get_env_var( L"PATHEXT", FEXEC );
-    if (extlen)
+    put_cache( &cache_dicts[i]->count, 4 );
+    for (d = cache_dicts[i]->head; d; d = d->next)
     {
-      PWSTR e = envvar.txt;
-      int   d = 0, cnt = lenof(buf), sz;
-      f = buf;
-      while (*e)
-      {
-	while (e[++d] != '.' && e[d] != ';' && e[d] != ':' && e[d] != '\0') ;
-	sz = _snwprintf( f, cnt, L"%s%.*s;", line.txt+fname_pos, d, e );
-	f += sz;
-	cnt -= sz;
-	if (e[d] == ';' || e[d] == ':')
-	  ++d;
-	e += d;
-	d = 0;
-      }
-      f[-1] = '\0';
+      put_text( d->name, d->len );
+      for (cnt = 0, ll = d->line; ll; ll = ll->next)
+	++cnt;
+      put_cache( &cnt, 4 );
+      for (ll = d->line; ll; ll = ll->next)
+	put_text( ll->line, ll->len );
     }
   }
-  if (!*buf)
-    wcscpy( buf, line.txt+fname_pos );
 
-  len += 1 + wcslen( buf ) + 1 + 13;
-  f = malloc( WSZ(len) );
-  if (f)
+  index_sections( cfg, hdr );
+
+  if (cache_ok)
   {
-    _snwprintf( f, len, L"%s%c%s%cAll files%c*%c",
-		line.txt+fname_pos, 0, buf, 0, 0, 0 );
+    cnt = hash_bytes( cache_buf + sizeof(CacheHdr),
+		      cache_len - sizeof(CacheHdr) );
+    put_cache( &cnt, 4 );
   }
-  return f;
+  if (cache_ok)
+  {
+    _snwprintf( tmp, lenof(tmp), L"%s.%lu", cname, GetCurrentProcessId() );
+    out = _wfopen( tmp, L"wb" );
+    if (out != NULL)
+    {
+      ok = (fwrite( cache_buf, cache_len, 1, out ) == 1);
+      if (fclose( out ) != 0 || !ok ||
+	  !MoveFileEx( tmp, cname, MOVEFILE_REPLACE_EXISTING ))
+	DeleteFile( tmp );
+    }
+  }
+
+done:
+  free( cache_buf );
+  cache_buf = NULL;
+  cache_max = 0;
 }
 
 
-// Make an absolute path a relative path and ensure it ends with a backslash.
-// If path starts with the current directory remove that portion.  If the cwd
-// is one or two levels below path, use the shortcuts.	Otherwise keep the
-// complete path.
-void make_relative( PWSTR path, PWSTR rel )
+// Add the index of the directory sections of cfg to the cache: the number of
+// sections (or ~0 if a line is too long to be sure of finding them), then the
+// position, line number and hash of each, followed by its directory.  Since
+// skipped sections aren't executed, every '#' line is the start of one.
+void index_sections( PBYTE cfg, const CacheHdr* hdr )
 {
-  WCHAR buf[MAX_PATH];
-  PWSTR cwd = buf, dir, root;
+  WCHAR dir[MAX_PATH];
+  PBYTE nl;
+  DWORD pos, end, num, cnt, ofs, len;
 
-  GetCurrentDirectory( MAX_PATH, cwd );
-  if (*cwd == *path)
-  {
-    *rel = '\0';
-  }
-  else
-  {
-    rel[0] = *path;
-    rel[1] = ':';
-    rel[2] = '\0';
-    GetFullPathName( rel, MAX_PATH, cwd, NULL );
-    rel += 2;
-  }
-  cwd  += 2;
-  path += 2;
-  root	= path;
+  ofs = cache_len;
+  cnt = 0;
+  put_cache( &cnt, 4 );
 
-  // Root current directory is always relative.
-  if (cwd[1] == '\0')
+  for (pos = hdr->sect, num = hdr->sect_line; num && pos < hdr->size; ++num)
   {
-    if (*path != '\0')
+    nl	= memchr( cfg + pos, '\n', hdr->size - pos );
+    end = (nl) ? nl - cfg : hdr->size;
+    if (end - pos > 2046)		// see get_file_line
     {
-      wcscpy( rel, path+1 );
-      wcscat( rel, L"\\" );
+      cnt = ~0;
+      break;
     }
-    return;
+    if (cfg[pos] == '#')
+    {
+      // Match get_file_line, which expects the line to end with a newline.
+      len = end - pos - 1;
+      if (len && (!nl || cfg[end-1] == '\r'))
+	--len;
+      len = (len) ? MultiByteToWideChar( filecp, 0, (LPCSTR)cfg + pos + 1, len,
+					 dir, lenof(dir) ) : 0;
+      if (len)				// empty or too long can't match
+      {
+	put_cache( &pos, 4 );
+	put_cache( &num, 4 );
+	end = hash_name( dir, len );
+	put_cache( &end, 4 );
+	put_text( dir, len );
+	++cnt;
+      }
+    }
+    if (nl == NULL)
+      break;
+    pos = nl - cfg + 1;
   }
 
-  // Root path is always absolute.
-  if (*path == '\0')
-  {
-    wcscat( rel, L"\\" );
-    return;
-  }
+  if (cache_ok)
+    memcpy( cache_buf + ofs, &cnt, 4 );
+}
 
-  // Skip over the common directories.
-  dir = cwd;
-  while (*++path == *++cwd && *path)
-  {
-    if (*cwd == '\\')
-      dir = cwd;
-  }
 
-  // In the current directory.
-  if (*cwd == '\0' && *path == '\0')
+// Add size bytes of mem to the cache.
+void put_cache( const void* mem, DWORD size )
+{
+  PBYTE buf;
+  DWORD len;
+
+  if (!cache_ok)
     return;
 
-  // Below the current directory.
-  if (*cwd == '\0' && *path == '\\')
-  {
-    root = path + 1;
-  }
-  else
+  if (cache_len + size > cache_max)
   {
-    if (*cwd == '\\' && *path == '\0')
-      dir = cwd;
-    else
-      path -= cwd - dir;
-
-    // One level above, use parent shortcut.
-    dir = wcschr( dir+1, '\\' );
-    if (dir == NULL)
-    {
-      wcscpy( rel, L".." );
-      rel += 2;
-      root = path;
-    }
-    else
+    len = cache_max + cache_len + size + 4096;
+    buf = realloc( cache_buf, len );
+    if (buf == NULL)
     {
-      // Two levels above, use two parent shortcuts.
-      dir = wcschr( dir+1, '\\' );
-      if (dir == NULL)
-      {
-	wcscpy( rel, L"..\\.." );
-	rel += 5;
-	root = path;
-      }
+      cache_ok = FALSE;
+      return;
     }
+    cache_buf = buf;
+    cache_max = len;
   }
+  memcpy( cache_buf + cache_len, mem, size );
+  cache_len += size;
+}
 
-  wcscpy( rel, root );
-  wcscat( rel, L"\\" );
+
+// Add the length of txt, then txt itself, to the cache.
+void put_text( PCWSTR txt, DWORD len )
+{
+  put_cache( &len, 4 );
+  put_cache( txt, WSZ(len) );
 }
 
 
@@ -3376,30 +5489,111 @@ void make_relative( PWSTR path, PWSTR rel )
 // will be added to the history.
 BOOL read_cmdfile( PCWSTR name )
 {
-  BOOL	rc = FALSE;
-  BOOL	skip, cond;
-  WCHAR cwd[MAX_PATH];
+  BOOL	   rc = FALSE;
+  BOOL	   skip, cond;
+  WCHAR    cwd[MAX_PATH];
+  WCHAR    cname[MAX_PATH+lenof(CACHE_EXT)];
+  CacheHdr hdr;
+  PBYTE    cfg;
+  BOOL	   cache, utf8;
 
   kbd = FALSE;
-  file = _wfopen( name, L"r" );
-  if (file != NULL)
+  cfg_listed = cfg_unhist = FALSE;
+
+  if (cfg_loaded != NULL)
   {
-    // Check for the UTF-8 byte-order mark.
-    if (getc( file ) == 0xEF && getc( file ) == 0xBB && getc( file ) == 0xBF)
-      filecp = CP_UTF8;
+    WaitForSingleObject( cfg_loaded, INFINITE );
+    CloseHandle( cfg_loaded );
+    cfg_loaded = NULL;
+  }
+
+  // The cache can only be used if nothing has been defined yet.  It only
+  // has the history lines added by the configuration, so they can be added
+  // to whatever history there is.
+  cfg = NULL;
+  cache = utf8 = FALSE;
+  if (!cfg_read && macro_head == NULL &&
+      macs.count == 0 && syms.count == 0 && assocs.count == 0)
+  {
+    if (pre_cfg != NULL)
+    {
+      cfg = pre_cfg;
+      hdr.size = pre_cfg_size;
+      hdr.time = pre_cfg_time;
+      pre_cfg = NULL;
+    }
     else
+      cfg = read_whole( name, &hdr.size, &hdr.time );
+    if (cfg)
+    {
+      hdr.magic   = CACHE_MAGIC;
+      hdr.version = PVERX;
+      hdr.options = hash_bytes( &option, sizeof(option) );
+      hdr.hash	  = hash_bytes( cfg, hdr.size );
+      hdr.sect	  = first_section( cfg, hdr.size, &hdr.sect_line );
+      utf8 = (hdr.size >= 3 && memcmp( cfg, "\xEF\xBB\xBF", 3 ) == 0);
+      cache = TRUE;
+      _snwprintf( cname, lenof(cname), L"%s" CACHE_EXT, name );
+    }
+  }
+  cfg_read = TRUE;
+  GetCurrentDirectory( MAX_PATH, cwd );
+
+  if (cache && load_cache( cname, &hdr, cwd ))
+  {
+    // Only the section for this directory remains to be read.
+    cache = FALSE;
+    free( cfg );
+    cfg = NULL;
+    if (hdr.sect_line == 0)
+      return TRUE;
+    file = _wfopen( name, L"r" );
+    if (file != NULL)
     {
-      rewind( file );
-      filecp = CP_OEMCP;
+      filecp = (utf8) ? CP_UTF8 : CP_OEMCP;
+      fseek( file, hdr.sect, SEEK_SET );
+      line_no = hdr.sect_line - 1;
     }
+  }
+  else
+  {
+    if (cache)
+    {
+      // Start the cache, leaving room for the number of history lines.
+      cache_len  = 0;
+      cache_ok	 = TRUE;
+      cache_hist = 0;
+      put_cache( &hdr, sizeof(CacheHdr) );
+      put_cache( &cache_hist, 4 );
+    }
+    file = _wfopen( name, L"r" );
+    if (file != NULL)
+    {
+      // Check for the UTF-8 byte-order mark.
+      if (getc( file ) == 0xEF && getc( file ) == 0xBB && getc( file ) == 0xBF)
+	filecp = CP_UTF8;
+      else
+      {
+	rewind( file );
+	filecp = CP_OEMCP;
+      }
+    }
+  }
+  if (file != NULL)
+  {
     file_name = name;
     make_line( 0 );
     skip = cond = FALSE;
-    GetCurrentDirectory( MAX_PATH, cwd );
     while (get_file_line( skip ))
     {
       if (*line.txt == '#')
       {
+	if (cache)
+	{
+	  cache = FALSE;
+	  if (line_no == hdr.sect_line) // not part of a macro
+	    save_cache( cname, &hdr, cfg );
+	}
 	if (cond)
 	  break;
 	line.txt[line.len] = '\0';
@@ -3426,9 +5620,12 @@ BOOL read_cmdfile( PCWSTR name )
 		tmp = path;
 	      }
 	    }
+	    // The loader may still be reading the current history file.
+	    merge_history();
 	    GetFullPathName( tmp, lenof(local.hstname), local.hstname, NULL );
 	    execute_rsth( 0 );
 	    read_history();
+	    merge_history();
 	    save_history = TRUE;
 	    // Loading a specific history precludes being primary.
 	    if (primary)
@@ -3442,8 +5639,17 @@ BOOL read_cmdfile( PCWSTR name )
 	continue;
       }
       if (!internal_cmd())
+      {
+	if (cache)
+	{
+	  put_text( line.txt, line.len );
+	  ++cache_hist;
+	}
 	add_to_history( TRUE );
+      }
     }
+    if (cache && hdr.sect_line == 0)
+      save_cache( cname, &hdr, cfg );
     if (seen_error)
     {
       kbd = TRUE;
@@ -3455,6 +5661,13 @@ BOOL read_cmdfile( PCWSTR name )
     file = NULL;
     rc = TRUE;
   }
+  free( cfg );
+  free( pre_cfg );
+  free( pre_cache );
+  pre_cfg = pre_cache = NULL;
+  free( cache_buf );			// a cache that wasn't saved
+  cache_buf = NULL;
+  cache_max = 0;
 
   return rc;
 }
@@ -3507,9 +5720,13 @@ void get_next_line( void )
   if (file)
     get_file_line( FALSE );
   else if (macro_stk)
+  {
+    use_history();
     get_macro_line( TRUE );
+  }
   else if (mcmd.txt)
   {
+    use_history();
     if (mcmd.len)
     {
       copy_chars( mcmd.txt, mcmd.len );
@@ -3527,66 +5744,143 @@ void get_next_line( void )
 
 // Retrieve a line from a macro, replacing "%n" with the nth argument (0 to 9),
 // "%*" with all arguments, or "%n*" with all arguments from the nth.  Use the
-// escape character to treat the '%' or '*' literally.
+// escape character to treat the '%' or '*' literally.  The line is built
+// separately and added all at once.
 void get_macro_line( BOOL first )
 {
-  DWORD pos, arg, cnt;
-  int	argnum, var;
-  Line	temp;
+  PMacroCall m = macro_stk;
+  PLineList  ll = m->line;
+  MacroPart* p;
+  PCWSTR     txt;
+  PWSTR      buf;
+  DWORD      len, cnt, i;
+
+  if (!ll->tmpl)
+    ll->tmpl = compile_macro( ll );
+
+  len = (first) ? m->len - m->end : 1;
+  if (ll->tmpl)
+  {
+    for (i = 0, p = ll->tmpl->part; i < ll->tmpl->parts; ++i, ++p)
+    {
+      macro_part( p, ll->line, &cnt );
+      len += cnt;
+    }
+  }
+  else
+    len += ll->len;			// no memory, so no arguments
+
+  if (make_length( &macro_buf, &macro_max, len ))
+  {
+    buf = macro_buf;
+    if (!first)
+      *buf++ = CMDSEP;
+    if (ll->tmpl)
+    {
+      for (i = 0, p = ll->tmpl->part; i < ll->tmpl->parts; ++i, ++p)
+      {
+	txt = macro_part( p, ll->line, &cnt );
+	memcpy( buf, txt, WSZ(cnt) );
+	buf += cnt;
+      }
+    }
+    else
+    {
+      memcpy( buf, ll->line, WSZ(ll->len) );
+      buf += ll->len;
+    }
+    if (first)
+    {
+      // Use this rather than copy_chars so undoing the expansion will work.
+      memcpy( buf, m->txt + m->end, WSZ(m->len - m->end) );
+      replace_chars( 0, line.len, macro_buf, len );
+    }
+    else
+      insert_chars( line.len, macro_buf, len );
+  }
+  un_escape( ARG_ESCAPE );
+
+  m->line = ll->next;
+  if (m->line == NULL)
+    pop_macro();
+}
+
+
+// Split a macro line into literal text and arguments ("%n", "%*" or "%n*"),
+// so each use doesn't have to search for them.  The first pass counts the
+// pieces, the second fills them in.  Returns NULL if there's no memory.
+PMacroTmpl compile_macro( PLineList ll )
+{
+  PMacroTmpl t = NULL;
+  MacroPart* p;
+  PCWSTR     txt = ll->line;
+  DWORD      pos, lit, n;
 
-  if (first)
-  {
-    // Use this rather than copy_chars so undoing the expansion will work.
-    replace_chars( 0, line.len, macro_stk->line->line, macro_stk->line->len );
-  }
-  else
-  {
-    WCHAR sep = CMDSEP;
-    insert_chars( line.len, &sep, 1 );
-    insert_chars( line.len, macro_stk->line->line, macro_stk->line->len );
-  }
-  for (pos = 0; pos < line.len; ++pos)
+  for (;;)
   {
-    if (line.txt[pos] == ESCAPE)
-      ++pos;
-    else if (line.txt[pos] == VARIABLE && pos+1 < line.len &&
-	     (line.txt[pos+1] == '*' ||
-	      (line.txt[pos+1] >= '0' && line.txt[pos+1] <= '9')))
+    for (n = lit = pos = 0; pos < ll->len; ++pos)
     {
-      ++pos;
-      argnum   = (line.txt[pos] == '*') ? 2 : line.txt[pos] - '0' + 1;
-      temp     = line;
-      line.txt = macro_stk->name;
-      line.len = LOWORD(macro_stk->len);
-      arg = cnt = 0;
-      do
+      if (txt[pos] == ESCAPE)
+	++pos;
+      else if (txt[pos] == VARIABLE && pos+1 < ll->len &&
+	       (txt[pos+1] == '*' || (txt[pos+1] >= '0' && txt[pos+1] <= '9')))
       {
-	arg = get_string( arg + cnt, &cnt, TRUE );
-      } while (--argnum);
-      line = temp;
-      var  = 2;
-      if (line.txt[pos] != '*' && pos+1 < line.len && line.txt[pos+1] == '*')
+	if (pos > lit)
+	{
+	  if (t)
+	  {
+	    p = t->part + n;
+	    p->arg = -1;
+	    p->pos = lit;
+	    p->len = pos - lit;
+	  }
+	  ++n;
+	}
+	if (t)
+	{
+	  p = t->part + n;
+	  p->arg  = (txt[pos+1] == '*') ? 1 : txt[pos+1] - '0';
+	  p->rest = (txt[pos+1] == '*' || (pos+2 < ll->len && txt[pos+2] == '*'));
+	}
+	++n;
+	pos += (txt[pos+1] != '*' && pos+2 < ll->len && txt[pos+2] == '*') ? 2 : 1;
+	lit = pos + 1;
+      }
+    }
+    if (lit < ll->len)
+    {
+      if (t)
       {
-	++pos;
-	var = 3;
+	p = t->part + n;
+	p->arg = -1;
+	p->pos = lit;
+	p->len = ll->len - lit;
       }
-      if (line.txt[pos] == '*')
-	cnt = LOWORD(macro_stk->len) - arg;
-      pos -= var;
-      pos += replace_chars( pos + 1, var, macro_stk->name + arg, cnt );
+      ++n;
     }
+    if (t)
+      return t;
+
+    t = malloc( sizeof(MacroTmpl) + n * sizeof(MacroPart) );
+    if (!t)
+      return NULL;
+    t->parts = n;
   }
-  if (first)
+}
+
+
+// Return the text of a piece of a macro line (txt), using the arguments of
+// the executing macro, with its length in cnt.
+PCWSTR macro_part( MacroPart* p, PCWSTR txt, LPDWORD cnt )
+{
+  if (p->arg < 0)
   {
-    cnt = HIWORD(macro_stk->len) - LOWORD(macro_stk->len);
-    if (cnt)
-      insert_chars( pos, macro_stk->name + LOWORD(macro_stk->len), cnt );
+    *cnt = p->len;
+    return txt + p->pos;
   }
-  un_escape( ARG_ESCAPE );
-
-  macro_stk->line = macro_stk->line->next;
-  if (macro_stk->line == NULL)
-    pop_macro();
+  *cnt = (p->rest) ? macro_stk->end - macro_stk->arg[p->arg]
+		   : macro_stk->cnt[p->arg];
+  return macro_stk->txt + macro_stk->arg[p->arg];
 }
 
 
@@ -3595,7 +5889,7 @@ void pop_macro( void )
 {
   if (macro_stk)
   {
-    PDefine m = macro_stk;
+    PMacroCall m = macro_stk;
     macro_stk = macro_stk->next;
     free( m );
   }
@@ -3655,13 +5949,13 @@ void dosify( void )
   {
     if (line.txt[pos] == '/' || line.txt[pos] == '\\')
     {
-      line.txt[pos] = '\\';
+      put_char( pos, '\\' );
       if ((pos+1 == line.len || isblank( line.txt[pos+1] )) &&
 	  pos > 0 && line.txt[pos-1] != ':' && !isblank( line.txt[pos-1] ))
-	line.txt[pos] = ' ';
+	put_char( pos, ' ' );
     }
     else if (line.txt[pos] == '-' && pos > 0 && isblank( line.txt[pos-1] ))
-      line.txt[pos] = '/';
+      put_char( pos, '/' );
   }
 }
 
@@ -3675,26 +5969,39 @@ void dosify( void )
 // prepend terminator is a space, the postpend terminator will be used.
 // eg: a;b{1,2}c,d ==> a;b1c;b2c,d
 //     a b{1,2}c,d ==> a b1c,b2c,d
-BOOL brace_expansion( void )
+//
+// The line is brace_buf (see expand_braces), so this doesn't display or undo.
+// The search begins at *start, which is the start of a word (after separator
+// *sep); on return these are set to the start of the word with the first
+// brace, since nothing before it can change.  The size of the result is known
+// before it's made.
+// Returns 1 if braces were expanded, 0 if not, or -1 if the line would be too
+// long (or there's no memory).
+int brace_expansion( LPDWORD start, PWCHAR sep )
 {
   int	count;				// keep track of nested braces
   int	pos;
   int	prepos,  prelen;		// position and length of the prepend
   int	postpos, postlen;		// position and length of the postpend
+  int	commas; 			// number of items less one
+  DWORD newlen, reg;			// length of new line & expanded region
   WCHAR term;				// character used to separate items
-  PWSTR pend;				// copy of the postpend
+  int	p0;				// start of the word with the first brace
+  WCHAR t0;				// separator before it
+  PWSTR out;				// where the expansion is going
   BOOL	quote, q1;			// keep track of quotes
-  BOOL	comma;				// must be at least two items
 
-  prepos = pos = 0;
-  term	 = ' ';
+  prepos = pos = *start;
+  term	 = *sep;
   quote  = FALSE;
-  comma  = FALSE;
-  while (!comma)
+  commas = 0;
+  p0	 = -1;
+  t0	 = term;
+  while (commas == 0)
   {
     // Do a quick scan to see if it's worthwhile continuing.
-    if (!memchr( line.txt + pos, '{', WSZ(line.len) )) // } (maintain balance)
-      return FALSE;
+    if (!memchr( line.txt + pos, '{', WSZ(line.len - pos) )) // } (balance)
+      return 0;
 
     // Find the opening brace and the start of the prepend.
     for (; pos < line.len; ++pos)
@@ -3717,10 +6024,15 @@ BOOL brace_expansion( void )
       }
     }
     if (pos >= line.len)		// no opening brace
-      return FALSE;
+      return 0;
     prelen = pos - prepos;
+    if (p0 < 0)
+    {
+      p0 = prepos;
+      t0 = term;
+    }
 
-    // Find the closing brace, checking for at least two items.
+    // Find the closing brace, counting the items.
     q1 = FALSE;
     count = 1;
     for (postpos = ++pos; postpos < line.len; ++postpos)
@@ -3733,7 +6045,7 @@ BOOL brace_expansion( void )
       else if (is_quote( postpos ))
       {
 	if (quote)
-	  return FALSE; 		// quoted item with quoted prepend
+	  return 0;			// quoted item with quoted prepend
 	q1 = TRUE;
       }
       else if (line.txt[postpos] == ESCAPE)
@@ -3749,10 +6061,10 @@ BOOL brace_expansion( void )
 	  break;
       }
       else if (line.txt[postpos] == ',' && count == 1)
-	comma = TRUE;
+	++commas;
     }
     if (count)				// unbalanced braces
-      return FALSE;
+      return 0;
   }
 
   // Find the end of the postpend.  Made awkward by the use of quotes and
@@ -3803,22 +6115,24 @@ BOOL brace_expansion( void )
     }
   }
   if (quote || count)			// unbalanced quotes, braces
-    return FALSE;
+    return 0;
   postlen -= postpos;
   if (postlen < 0)
     postlen = 0;
 
-  // Make a copy of the postpend, including the terminator.
-  pend = new_txt( line.txt + postpos, postlen + 1 );
-  if (!pend)
-    return FALSE;
-  pend[postlen++] = term;
+  // Each comma becomes the postpend, separator and prepend; the braces go.
+  newlen = line.len + commas * (prelen + postlen) - 2;
+  if (newlen > max)
+    return -1;
+  reg = newlen - (line.len - (postpos + postlen - prepos));
+  if (!make_length( &brace_tmp, &brace_tmpmax, reg ))
+    return -1;
 
-  // Remove the opening brace, thus generating the first prepend.
-  pos = prepos + prelen;
-  remove_chars( pos, 1 );
-  // Now add the postpend and prepend to all subsequent items.
-  for (; count >= 0; ++pos)
+  // Build the expansion of the region from the prepend to the postpend.
+  out = brace_tmp;
+  memcpy( out, line.txt + prepos, WSZ(prelen) );
+  out += prelen;
+  for (pos = prepos + prelen + 1;; ++pos)
   {
     if (quote)
     {
@@ -3830,31 +6144,66 @@ BOOL brace_expansion( void )
     else if (line.txt[pos] == ESCAPE)
     {
       if (pos+1 < line.len)
-	++pos;
+	*out++ = line.txt[pos++];
     }
     else if (line.txt[pos] == '{')
       ++count;
     else if (line.txt[pos] == '}')
-      --count;
+    {
+      if (--count < 0)
+	break;
+    }
     else if (line.txt[pos] == ',' && count == 0)
     {
-      pos += replace_chars( pos, 1, pend, postlen );
-      pos += insert_chars( pos, line.txt + prepos, prelen ) - 1;
+      memcpy( out, line.txt + postpos, WSZ(postlen) );
+      out += postlen;
+      *out++ = term;
+      memcpy( out, line.txt + prepos, WSZ(prelen) );
+      out += prelen;
+      continue;
     }
+    *out++ = line.txt[pos];
   }
-  // Remove the closing brace, thus generating the last postpend.
-  remove_chars( pos - 1, 1 );
+  memcpy( out, line.txt + postpos, WSZ(postlen) );
 
-  free( pend );
+  // Now replace the region with its expansion.
+  memmove( line.txt + prepos + reg, line.txt + postpos + postlen,
+	   WSZ(line.len - postpos - postlen) );
+  put_chars( prepos, brace_tmp, reg );
+  line.len = newlen;
 
-  return TRUE;
+  *start = p0;
+  *sep	 = t0;
+  return 1;
 }
 
 
-// Keep expanding braces until no more, then replace escaped characters.
+// Keep expanding braces until no more, then replace escaped characters.  The
+// expansion takes place in a copy of the line, which replaces the line at the
+// end (or not at all, if it would be too long).
 void expand_braces( void )
 {
-  while (brace_expansion()) ;
+  Line	save;
+  DWORD start, len;
+  WCHAR sep;
+  int	rc, n;
+
+  if (memchr( line.txt, '{', WSZ(line.len) ) &&  // }
+      make_length( &brace_buf, &brace_max, max ))
+  {
+    memcpy( brace_buf, line.txt, WSZ(line.len) );
+    save = line;
+    line.txt = brace_buf;
+    start = 0;
+    sep = ' ';
+    for (n = 0; (rc = brace_expansion( &start, &sep )) > 0; ++n) ;
+    len  = line.len;
+    line = save;
+    if (rc < 0)
+      bell();
+    else if (n)
+      replace_chars( 0, line.len, brace_buf, len );
+  }
   un_escape( BRACE_ESCAPE );
 }
 
@@ -3881,9 +6230,9 @@ BOOL associate( void )
 
   if (line.txt[ext] == '/' || line.txt[ext] == '\\')
   {
-    line.txt[ext] = '\\';
-    a = find_define( &assoc_head, ext, 1 + alt );
-    if (!a)
+    put_char( ext, '\\' );
+    a = find_define( &assocs, ext, 1 + alt );
+    if (!a || seen_define( a ))
       return FALSE;
     if (cnt > 1 && line.txt[ext-1] != ':')
     {
@@ -3903,7 +6252,7 @@ BOOL associate( void )
 		     || line.txt[ext] == ':')
 	return FALSE;
     a = find_assoc( line.txt + ext, cnt + alt );
-    if (!a)
+    if (!a || seen_define( a ))
       return FALSE;
   }
 
@@ -3926,8 +6275,8 @@ BOOL expand_symbol( void )
   sym = skip_blank( 0 );
   end = skip_nondelim( sym );
 
-  s = find_define( &sym_head, sym, end - sym );
-  if (!s)
+  s = find_define( &syms, sym, end - sym );
+  if (!s || seen_define( s ))
     return FALSE;
 
   sp = (end < line.len && !isblank( line.txt[end] ));
@@ -3943,20 +6292,32 @@ BOOL expand_symbol( void )
 // If the first word is a macro, replace the line with its definition.
 BOOL expand_macro( void )
 {
-  PDefine m;
-  DWORD   mac, end;
-  BOOL	  quote;
+  PDefine    m;
+  PMacroCall stk;
+  DWORD      mac, end, arg, cnt, len;
+  BOOL	     quote;
+  int	     i;
 
   mac = skip_blank( 0 );
   end = skip_nondelim( mac );
 
-  m = find_define( &mac_head, mac, end - mac );
-  if (!m)
+  m = find_define( &macs, mac, end - mac );
+  if (!m || seen_define( m ))
     return FALSE;
+  // Nor can a macro invoke itself from a later line.
+  for (stk = macro_stk; stk; stk = stk->next)
+    if (stk->def == m)
+      return FALSE;
 
   // Make a copy of the line in order to remember the arguments.
-  if (!add_define( &macro_stk, 0, line.len ))
+  stk = malloc( sizeof(MacroCall) + WSZ(line.len) );
+  if (!stk)
     return FALSE;
+  memcpy( stk->txt, line.txt, WSZ(line.len) );
+  stk->len  = line.len;
+  stk->def  = m;
+  stk->next = macro_stk;
+  macro_stk = stk;
 
   // Separate secondary commands and redirection.  For example, given the def-
   // inition "defm ut unzip %* -dtemp", the command "ut zip |dnd" should expand
@@ -3985,15 +6346,170 @@ BOOL expand_macro( void )
       break;
     }
   }
-  macro_stk->len = (line.len << 16) | end;
+  stk->end = end;
+
+  // Find the arguments now, rather than every time one is used.
+  len = line.len;
+  line.len = end;
+  for (arg = cnt = 0, i = 0; i < MACRO_ARGS; ++i)
+  {
+    arg = get_string( arg + cnt, &cnt, TRUE );
+    stk->arg[i] = arg;
+    stk->cnt[i] = cnt;
+  }
+  line.len = len;
 
-  macro_stk->line = m->line;
+  stk->line = m->line;
   get_macro_line( TRUE );
 
   return TRUE;
 }
 
 
+// Expand braces, associations, symbols and macros at the start of the line
+// until none apply.  A line without a macro is remembered along with its
+// expansion, so repeating it (as in a loop or a batch of commands) can skip
+// straight to the result, provided the definitions haven't changed since.
+// Lines from a macro aren't remembered, since a macro won't expand itself.
+void expand_line( void )
+{
+  PMemo m;
+  DWORD hash, inlen;
+  BOOL	keep;
+
+  expansions = 0;
+  hash = inlen = 0;
+  keep = (check_break <= 1 && macro_stk == NULL);
+  if (keep)
+  {
+    hash = hash_name( line.txt, line.len );
+    m = find_memo( hash );
+    if (m)
+    {
+      replace_chars( 0, line.len, m->txt + m->inlen, m->outlen );
+      return;
+    }
+    inlen = line.len;
+    keep = make_length( &memo_in, &memo_max, inlen );
+    if (keep)
+      memcpy( memo_in, line.txt, WSZ(inlen) );
+  }
+
+  for (;;)
+  {
+    if (check_break > 1)
+    {
+      keep = FALSE;
+      break;
+    }
+    if (line.len != 0 && *line.txt == '@')
+    {
+      remove_chars( 0, 1 );
+      dosify();
+    }
+    if (line.len != 0 && *line.txt == option.ignore_char)
+    {
+      remove_chars( 0, 1 );
+      keep = FALSE;
+      break;
+    }
+    expand_braces();
+    // Don't bother looking for a definition when there are none.
+    if (assocs.count && associate())
+      continue;
+    if (syms.count && expand_symbol())
+      continue;
+    if (macs.count && expand_macro())
+    {
+      keep = FALSE;			// the remaining lines are on the stack
+      continue;
+    }
+    break;
+  }
+
+  if (keep)
+    add_memo( hash, inlen );
+}
+
+
+// Return TRUE if the definition has already been expanded in this line (or
+// too many have), which is how recursive definitions end.  Otherwise add it
+// to the list of expansions.
+BOOL seen_define( PDefine d )
+{
+  int j;
+
+  for (j = 0; j < expansions; ++j)
+    if (expanded[j] == d)
+      return TRUE;
+
+  if (expansions == EXPANSIONS)
+    return TRUE;
+
+  expanded[expansions++] = d;
+  return FALSE;
+}
+
+
+// Find the remembered expansion of the line (with hash), making it the most
+// recent.  Returns NULL if there isn't one for the current definitions.
+PMemo find_memo( DWORD hash )
+{
+  PMemo m;
+
+  for (m = memo.next; m != &memo; m = m->next)
+  {
+    if (m->hash == hash && m->inlen == line.len && m->gen == defs_gen &&
+	m->ign == option.ignore_char &&
+	memcmp( m->txt, line.txt, WSZ(line.len) ) == 0)
+    {
+      m->prev->next = m->next;
+      m->next->prev = m->prev;
+      m->next = memo.next;
+      m->prev = &memo;
+      memo.next->prev = m;
+      memo.next = m;
+      return m;
+    }
+  }
+
+  return NULL;
+}
+
+
+// Remember that memo_in (inlen characters with hash) expands to the line,
+// forgetting the least recently used expansion if need be.
+void add_memo( DWORD hash, DWORD inlen )
+{
+  PMemo m;
+
+  if (memos == MEMO_LINES)
+  {
+    m = memo.prev;
+    m->prev->next = &memo;
+    memo.prev = m->prev;
+    free( m );
+    --memos;
+  }
+
+  m = malloc( sizeof(Memo) + WSZ(inlen + line.len) );
+  if (!m)
+    return;
+  m->gen    = defs_gen;
+  m->ign    = option.ignore_char;
+  m->hash   = hash;
+  m->inlen  = inlen;
+  m->outlen = line.len;
+  memcpy( m->txt, memo_in, WSZ(inlen) );
+  memcpy( m->txt + inlen, line.txt, WSZ(line.len) );
+  m->next = memo.next;
+  m->prev = &memo;
+  memo.next->prev = m;
+  memo.next = m;
+  ++memos;
+}
+
+
 // Determine if the first word is meant for CMDread and execute it if so.
 BOOL internal_cmd( void )
 {
@@ -4026,6 +6542,10 @@ BOOL internal_cmd( void )
 #endif
     un_escape( NULL );
 
+  // Most commands don't change a definition, but it's simpler to assume they
+  // all might.
+  ++defs_gen;
+
   pos = skip_blank( pos + cnt );
 #ifndef _WIN64
   ((IntFunc)func)( pos );
@@ -4076,7 +6596,7 @@ void expand_vars( BOOL env )
 	fndenv = TRUE;
 	cnt = end - start;
 	ch = line.txt[end];
-	line.txt[end] = '\0';
+	put_char( end, '\0' );
 	var.len = get_env_var( line.txt + start, NULL );
 	var.txt = envvar.txt;
 	if (!var.len)
@@ -4103,10 +6623,10 @@ void expand_vars( BOOL env )
 	    }
 	  }
 	}
-	line.txt[end] = ch;
+	put_char( end, ch );
 	if (!fndenv && end == pos)
 	{
-	  d = find_define( &sym_head, start, cnt );
+	  d = find_define( &syms, start, cnt );
 	  if (d)
 	  {
 	    var.txt = d->line->line;
@@ -4147,9 +6667,16 @@ void execute_defa( DWORD pos )
   if (def == line.len)
     return;
 
-  a = add_define( &assoc_head, pos, end - pos );
+  a = add_define( &assocs, pos, end - pos );
   if (a)
+  {
     a->line = add_line( def );
+    if (!a->line || !index_exts( &assoc_exts, a, a->name, a->len ))
+    {
+      unindex_exts( &assoc_exts, a );
+      del_define( &assocs, a );
+    }
+  }
 }
 
 
@@ -4296,11 +6823,11 @@ void execute_defm( DWORD pos )
   }
   cnt = end - pos;
 
-  mac = find_define( &sym_head, pos, cnt );
+  mac = find_define( &syms, pos, cnt );
   if (mac)
-    del_define( &sym_head );
+    del_define( &syms, mac );
 
-  mac = find_define( &mac_head, pos, cnt );
+  mac = find_define( &macs, pos, cnt );
   if (mac)
   {
     free_linelist( mac->line );
@@ -4308,7 +6835,7 @@ void execute_defm( DWORD pos )
   }
   else
   {
-    mac = add_define( &mac_head, pos, cnt );
+    mac = add_define( &macs, pos, cnt );
     if (!mac)
       goto ret;
   }
@@ -4318,7 +6845,7 @@ void execute_defm( DWORD pos )
   {
     mac->line = add_line( def );
     if (!mac->line)
-      del_define( &mac_head );
+      del_define( &macs, mac );
     goto ret;
   }
 
@@ -4342,7 +6869,7 @@ void execute_defm( DWORD pos )
       break;
   }
   if (!ll)
-    del_define( &mac_head );
+    del_define( &macs, mac );
 
 ret:
   def_macro = FALSE;
@@ -4368,11 +6895,11 @@ void execute_defs( DWORD pos )
   }
   cnt = end - pos;
 
-  sym = find_define( &mac_head, pos, cnt );
+  sym = find_define( &macs, pos, cnt );
   if (sym)
-    del_define( &mac_head );
+    del_define( &macs, sym );
 
-  sym = find_define( &sym_head, pos, cnt );
+  sym = find_define( &syms, pos, cnt );
   if (sym && sym->line)
   {
     free( sym->line );
@@ -4383,19 +6910,19 @@ void execute_defs( DWORD pos )
   if (def == line.len)			// defining to nothing
   {					//  so wipe it
     if (sym)
-      del_define( &sym_head );
+      del_define( &syms, sym );
     return;
   }
 
   if (!sym)
   {
-    sym = add_define( &sym_head, pos, cnt );
+    sym = add_define( &syms, pos, cnt );
     if (!sym)
       return;
   }
   sym->line = add_line( def );
   if (!sym->line)
-    del_define( &sym_head );
+    del_define( &syms, sym );
 }
 
 
@@ -4411,16 +6938,20 @@ void execute_dela( DWORD pos )
   {
     end = skip_nonblank( pos );
     cnt = end - pos;
-    a	= find_define( &assoc_head, pos, cnt );
+    a	= find_define( &assocs, pos, cnt );
     if (a)
-      del_define( &assoc_head );
+    {
+      unindex_exts( &assoc_exts, a );
+      del_define( &assocs, a );
+    }
     else
     {
       a = find_assoc( line.txt + pos, cnt );
       if (a)
       {
+	unindex_exts( &assoc_exts, a );
 	if (a->len == cnt)
-	  del_define( &assoc_head );
+	  del_define( &assocs, a );
 	else
 	{
 	  if (assoc_pos + cnt < a->len &&
@@ -4430,6 +6961,16 @@ void execute_dela( DWORD pos )
 	  memmove( a->name + assoc_pos, a->name + assoc_pos + cnt,
 		   WSZ(a->len - assoc_pos - cnt) );
 	  a->len -= cnt;
+	  // The name has changed, so it belongs in another bucket and its
+	  // remaining extensions have moved.
+	  unchain_define( &assocs, a );
+	  a->hash = hash_name( a->name, a->len );
+	  chain_define( &assocs, a );
+	  if (!index_exts( &assoc_exts, a, a->name, a->len ))
+	  {
+	    unindex_exts( &assoc_exts, a );
+	    del_define( &assocs, a );
+	  }
 	}
       }
     }
@@ -4444,6 +6985,8 @@ void execute_delh( DWORD pos )
   PHistory h, n;
   int end;
 
+  use_history();			// a configuration runs before the merge
+  cfg_unhist = TRUE;
   remove_from_history( history.prev );	// the DELH line
 
   // Use RSTH to delete everything, not empty text.
@@ -4489,14 +7032,14 @@ void execute_delk( DWORD pos )
 // Delete one or more macros.
 void execute_delm( DWORD pos )
 {
-  delete_define( &mac_head, pos );
+  delete_define( &macs, pos );
 }
 
 
 // Delete one or more symbols.
 void execute_dels( DWORD pos )
 {
-  delete_define( &sym_head, pos );
+  delete_define( &syms, pos );
 }
 
 
@@ -4512,7 +7055,7 @@ void execute_lsta( DWORD pos )
 
   if (pos == line.len)
   {
-    for (a = assoc_head; a; a = a->next)
+    for (a = assocs.head; a; a = a->next)
       list_define( a, 'a' );
   }
   else
@@ -4544,27 +7087,43 @@ void execute_lsta( DWORD pos )
 void execute_lsth( DWORD pos )
 {
   PHistory h;
-  DWORD    cnt;
+  DWORD    cnt, beg, n;
   BOOL	   back, find;
   int	   end;
+  WCHAR    ch;
 
-  // Unescape manually, to allow for escaped redirection characters.
+  // Unescape manually, to allow for escaped redirection characters.  The
+  // text is unescaped into a buffer and written back in one go.
+  if (!make_length( &esc_buf, &esc_max, line.len - pos ))
+    return;
   find = FALSE;
+  beg = pos;
+  n = 0;
   for (end = pos; end < line.len; ++end)
   {
-    if (line.txt[end] == ESCAPE && end+1 < line.len)
+    ch = line.txt[end];
+    if (ch == ESCAPE && end+1 < line.len)
     {
-      if (end == pos)
+      if (n == 0)
 	find = TRUE;
-      remove_chars( end, 1 );
+      ch = line.txt[++end];
     }
-    else if (line.txt[end] == '>' || line.txt[end] == '|')
+    else if (ch == '>' || ch == '|')
     {
-      if (line.txt[end-1] == ' ')
-	remove_chars( --end, 1 );
+      if (n != 0)
+      {
+	if (esc_buf[n-1] == ' ')
+	  --n;
+      }
+      else if (pos != 0 && line.txt[pos-1] == ' ')
+	beg = pos - 1;
       break;
     }
+    esc_buf[n++] = ch;
   }
+  if (end - beg != n)
+    replace_chars( beg, end - beg, esc_buf, n );
+  end = beg + n;
   if (!redirect( end ))
     return;
 
@@ -4717,21 +7276,105 @@ void execute_lstk( DWORD pos )
 // List macros.
 void execute_lstm( DWORD pos )
 {
-  list_defines( &mac_head, pos );
+  list_defines( &macs, pos );
 }
 
 
 // List symbols.
 void execute_lsts( DWORD pos )
 {
-  list_defines( &sym_head, pos );
+  list_defines( &syms, pos );
+}
+
+
+// List the timings: how often each function has been used and how long it
+// took (from reading the key to updating the display), followed by file name
+// completion, the history searches and the expansion of the line.
+void execute_lstt( DWORD pos )
+{
+  int j;
+
+  if (!redirect( pos ))
+    return;
+
+  for (j = 0; j < LastFunc; ++j)
+    list_latency( func_str[j], lat_func + j );
+  list_latency( L"(completion)", lat_extra + LAT_FIND );
+  list_latency( L"(search)", lat_extra + LAT_SEARCH );
+  list_latency( L"(expansion)", lat_extra + LAT_EXPAND );
+
+  if (metrics.keys != 0)
+    fwprintf( lstout, L"Per key (%I64d): %.1f console writes, %.1f chars.\n",
+	      metrics.keys, (double)metrics.con_calls / metrics.keys,
+	      (double)metrics.con_chars / metrics.keys );
+
+  end_redirect();
+}
+
+
+// List the latency of one thing (if it's been used): count, average, the
+// median and 99th percentile, and the histogram (the number less than each
+// power of two microseconds).
+void list_latency( PCWSTR name, const Latency* lat )
+{
+  int j;
+
+  if (lat->count == 0)
+    return;
+
+  fwprintf( lstout, L"%-14s%7lu%9.1f us  p50", name, lat->count,
+	    lat->total * 1e6 / lat_freq / lat->count );
+  list_bound( lat_percentile( lat, 50 ) );
+  fputws( L" p99", lstout );
+  list_bound( lat_percentile( lat, 99 ) );
+  fputws( L" ", lstout );
+  for (j = 0; j < LAT_BUCKETS; ++j)
+  {
+    if (lat->bucket[j] != 0)
+    {
+      list_bound( j );
+      fwprintf( lstout, L":%lu", lat->bucket[j] );
+    }
+  }
+  fputwc( '\n', lstout );
+}
+
+
+// Return the bucket that holds the percentile (so it's only known to the power
+// of two).
+int lat_percentile( const Latency* lat, int pct )
+{
+  DWORD want, sum;
+  int	j;
+
+  want = (DWORD)(((LONGLONG)lat->count * pct + 99) / 100);
+  sum  = 0;
+  for (j = 0; j < LAT_BUCKETS - 1; ++j)
+  {
+    sum += lat->bucket[j];
+    if (sum >= want)
+      break;
+  }
+  return j;
+}
+
+
+// List the bound of a bucket: less than its power of two, or at least the
+// previous for the last.
+void list_bound( int j )
+{
+  if (j == LAT_BUCKETS - 1)
+    fwprintf( lstout, L" >=%lu", 1UL << (j - 1) );
+  else
+    fwprintf( lstout, L" <%lu", 1UL << j );
 }
 
 
 // Delete every association.
 void execute_rsta( DWORD pos )
 {
-  reset_define( &assoc_head );
+  reset_exts( &assoc_exts );
+  reset_define( &assocs );
 }
 
 
@@ -4740,6 +7383,8 @@ void execute_rsth( DWORD pos )
 {
   PHistory h, p;
 
+  use_history();			// a configuration runs before the merge
+  cfg_unhist = TRUE;
   for (h = history.prev; h != &history; h = p)
   {
     p = h->prev;
@@ -4747,20 +7392,22 @@ void execute_rsth( DWORD pos )
   }
   history.prev = history.next = &history;
   histsize = 0;
+  metrics.hist_bytes = 0;
+  free_tokens( &tokens );
 }
 
 
 // Delete every macro.
 void execute_rstm( DWORD pos )
 {
-  reset_define( &mac_head );
+  reset_define( &macs );
 }
 
 
 // Delete every symbol.
 void execute_rsts( DWORD pos )
 {
-  reset_define( &sym_head );
+  reset_define( &syms );
 }
 
 
@@ -4775,6 +7422,7 @@ BOOL redirect( DWORD pos )
   lstpipe = FALSE;
   lstout  = stdout;
   append  = 0;
+  cfg_listed = TRUE;
   for (; pos < line.len; ++pos)
   {
     // No real need to test the quoting of these.
@@ -4797,7 +7445,7 @@ BOOL redirect( DWORD pos )
 	_putws( L"CMDread: syntax error." );
 	return FALSE;
       }
-      line.txt[beg+end] = '\0';
+      put_char( beg + end, '\0' );
       if (line.txt[pos] == '|')
       {
 	lstpipe = TRUE;
@@ -5032,87 +7680,311 @@ void del_macro( char* key )
 // ----------------------------   Definitions	------------------------------
 
 
-// Add a definition to the list.  The new definition becomes the head.
-PDefine add_define( PDefine* head, DWORD pos, DWORD cnt )
+// Hash cnt characters of name, ignoring case (FNV-1a).
+DWORD hash_name( PCWSTR name, DWORD cnt )
+{
+  DWORD h = 2166136261u;
+
+  while (cnt-- > 0)
+  {
+    h ^= towlower( *name++ );
+    h *= 16777619;
+  }
+
+  return h;
+}
+
+
+// Allocate a definition of cnt characters of name, not yet part of any set.
+PDefine new_define( PCWSTR name, DWORD cnt )
 {
   PDefine d;
 
   d = malloc( sizeof(Define) + WSZ(cnt) );
   if (d)
   {
-    memcpy( d->name, line.txt + pos, WSZ(cnt) );
+    memcpy( d->name, name, WSZ(cnt) );
     d->len  = cnt;
     d->line = NULL;
-    d->next = *head;
-    *head   = d;
+    d->next = d->prev = d->chain = NULL;
+    d->hash = 0;
+  }
+
+  return d;
+}
+
+
+// Double the number of buckets (or create the first lot) and rechain every
+// definition.  Returns FALSE only if there are no buckets at all.
+BOOL grow_dict( PDict dict )
+{
+  PDefine* hash;
+  PDefine  d;
+  DWORD    size;
+
+  size = (dict->size) ? dict->size * 2 : DICT_SIZE;
+  hash = calloc( size, sizeof(PDefine) );
+  if (!hash)
+    return (dict->size != 0);		// longer chains, but it still works
+
+  free( dict->hash );
+  dict->hash = hash;
+  dict->size = size;
+  for (d = dict->head; d; d = d->next)
+    chain_define( dict, d );
+
+  return TRUE;
+}
+
+
+// Put a definition at the start of its bucket.
+void chain_define( PDict dict, PDefine d )
+{
+  PDefine* b;
+
+  b = dict->hash + (d->hash & (dict->size - 1));
+  d->chain = *b;
+  *b = d;
+}
+
+
+// Take a definition out of its bucket.
+void unchain_define( PDict dict, PDefine d )
+{
+  PDefine* b;
+
+  for (b = dict->hash + (d->hash & (dict->size - 1)); *b != d; b = &(*b)->chain)
+    ;
+  *b = d->chain;
+}
+
+
+// Add a definition to the set.  The new definition is listed last.
+PDefine add_define( PDict dict, DWORD pos, DWORD cnt )
+{
+  PDefine d;
+
+  if (dict->count >= dict->size && !grow_dict( dict ))
+    return NULL;
+
+  d = new_define( line.txt + pos, cnt );
+  if (d)
+  {
+    d->hash = hash_name( d->name, cnt );
+    chain_define( dict, d );
+    d->prev = dict->tail;
+    if (dict->tail)
+      dict->tail->next = d;
+    else
+      dict->head = d;
+    dict->tail = d;
+    ++dict->count;
+  }
+
+  return d;
+}
+
+
+// Find the definition in the set.  Returns NULL if not found.
+PDefine find_define( PDict dict, DWORD pos, DWORD cnt )
+{
+  PDefine d;
+  DWORD   h;
+
+  if (dict->count == 0)
+    return NULL;
+
+  h = hash_name( line.txt + pos, cnt );
+  for (d = dict->hash[h & (dict->size - 1)]; d; d = d->chain)
+  {
+    if (d->hash == h && d->len == cnt &&
+	_wcsnicmp( d->name, line.txt + pos, cnt ) == 0)
+      break;
   }
 
   return d;
 }
 
 
-// Find the definition in the list.  Returns NULL if not found; otherwise moves
-// the definition to the head and returns it.
-PDefine find_define( PDefine* head, DWORD pos, DWORD cnt )
+// Search the associations for ext.  Return pointer to definition if found
+// (with assoc_pos set to the extension's position in its name); otherwise
+// NULL.
+PDefine find_assoc( PCWSTR ext, DWORD cnt )
+{
+  PExt e;
+
+  e = find_ext( &assoc_exts, ext, cnt );
+  if (!e)
+    return NULL;
+
+  assoc_pos = e->ext - e->def->name;
+  return e->def;
+}
+
+
+// Double the number of buckets (or create the first lot) and rechain every
+// extension.  Returns FALSE only if there are no buckets at all.
+BOOL grow_exts( PExtMap map )
+{
+  PExt* hash;
+  PExt	e, n;
+  DWORD size, i;
+
+  size = (map->size) ? map->size * 2 : DICT_SIZE;
+  hash = calloc( size, sizeof(PExt) );
+  if (!hash)
+    return (map->size != 0);
+
+  for (i = 0; i < map->size; ++i)
+  {
+    for (e = map->hash[i]; e; e = n)
+    {
+      n = e->chain;
+      e->chain = hash[e->hash & (size - 1)];
+      hash[e->hash & (size - 1)] = e;
+    }
+  }
+  free( map->hash );
+  map->hash = hash;
+  map->size = size;
+
+  return TRUE;
+}
+
+
+// Add each extension of list (len characters, split the same as match_ext)
+// to the index, belonging to association d.  A later extension hides an
+// earlier one of the same name.  Returns FALSE if memory ran out.
+BOOL index_exts( PExtMap map, PDefine d, PCWSTR list, DWORD len )
+{
+  PExt	e;
+  PExt* b;
+  DWORD pos, end;
+
+  for (pos = 0; pos < len; pos = end)
+  {
+    for (end = pos; ++end < len && list[end] != '.' &&
+				   list[end] != ';' &&
+				   list[end] != ':';) ;
+    if (map->count >= map->size && !grow_exts( map ))
+      return FALSE;
+    e = malloc( sizeof(Ext) );
+    if (!e)
+      return FALSE;
+    e->def  = d;
+    e->ext  = list + pos;
+    e->len  = end - pos;
+    e->hash = hash_name( e->ext, e->len );
+    b = map->hash + (e->hash & (map->size - 1));
+    e->chain = *b;
+    *b = e;
+    ++map->count;
+    if (end == len)
+      break;
+    if (list[end] != '.')
+      ++end;
+  }
+
+  return TRUE;
+}
+
+
+// Remove the extensions of association d from the index.  Only the buckets of
+// its own extensions need to be searched.
+void unindex_exts( PExtMap map, PDefine d )
 {
-  PDefine d, p;
+  PExt* b;
+  PExt	e;
+  DWORD pos, end;
+
+  if (map->count == 0)
+    return;
 
-  for (p = NULL, d = *head; d; p = d, d = d->next)
+  for (pos = 0; pos < d->len; pos = end)
   {
-    if (d->len == cnt && _wcsnicmp( d->name, line.txt + pos, cnt ) == 0)
+    for (end = pos; ++end < d->len && d->name[end] != '.' &&
+				      d->name[end] != ';' &&
+				      d->name[end] != ':';) ;
+    b = map->hash + (hash_name( d->name + pos, end - pos ) & (map->size - 1));
+    while (*b)
     {
-      if (p)
+      e = *b;
+      if (e->def == d)
       {
-	p->next = d->next;
-	d->next = *head;
-	*head	= d;
+	*b = e->chain;
+	free( e );
+	--map->count;
       }
-      break;
+      else
+	b = &e->chain;
     }
+    if (end == d->len)
+      break;
+    if (d->name[end] != '.')
+      ++end;
   }
-
-  return d;
 }
 
 
-// Search the list of associations for ext.  Return pointer to definition if
-// found and move it to the head; otherwise NULL.
-PDefine find_assoc( PCWSTR ext, DWORD cnt )
+// Find ext, of cnt characters, in the index.  Returns NULL if not found.
+PExt find_ext( PExtMap map, PCWSTR ext, DWORD cnt )
 {
-  PDefine a, p;
+  PExt	e;
+  DWORD h;
+
+  if (map->count == 0)
+    return NULL;
 
-  for (p = NULL, a = assoc_head; a; p = a, a = a->next)
+  h = hash_name( ext, cnt );
+  for (e = map->hash[h & (map->size - 1)]; e; e = e->chain)
   {
-    if (match_ext( ext, cnt, a->name, a->len ))
-    {
-      if (p)
-      {
-	p->next = a->next;
-	a->next = assoc_head;
-	assoc_head = a;
-      }
+    if (e->hash == h && e->len == cnt && _wcsnicmp( e->ext, ext, cnt ) == 0)
       break;
-    }
   }
 
-  return a;
+  return e;
 }
 
 
-// Remove the head of the list.
-void del_define( PDefine* head )
+// Remove every extension from the index.
+void reset_exts( PExtMap map )
 {
-  PDefine d;
+  PExt	e, n;
+  DWORD i;
+
+  for (i = 0; i < map->size; ++i)
+  {
+    for (e = map->hash[i]; e; e = n)
+    {
+      n = e->chain;
+      free( e );
+    }
+  }
+  free( map->hash );
+  memset( map, 0, sizeof(ExtMap) );
+}
+
 
-  d = *head;
-  *head = d->next;
+// Remove a definition from the set.
+void del_define( PDict dict, PDefine d )
+{
+  unchain_define( dict, d );
+  if (d->prev)
+    d->prev->next = d->next;
+  else
+    dict->head = d->next;
+  if (d->next)
+    d->next->prev = d->prev;
+  else
+    dict->tail = d->prev;
+  --dict->count;
   free_linelist( d->line );
   free( d );
 }
 
 
 // Delete a list of definitions.
-void delete_define( PDefine* head, DWORD pos )
+void delete_define( PDict dict, DWORD pos )
 {
   DWORD   end;
   PDefine d;
@@ -5120,26 +7992,27 @@ void delete_define( PDefine* head, DWORD pos )
   while (pos < line.len)
   {
     end = skip_nonblank( pos );
-    d = find_define( head, pos, end - pos );
+    d = find_define( dict, pos, end - pos );
     if (d)
-      del_define( head );
+      del_define( dict, d );
     pos = skip_blank( end );
   }
 }
 
 
-// Delete every definition in the list.
-void reset_define( PDefine* head )
+// Delete every definition in the set.
+void reset_define( PDict dict )
 {
-  PDefine p;
+  PDefine d, n;
 
-  while (*head)
+  for (d = dict->head; d; d = n)
   {
-    p = (*head)->next;
-    free_linelist( (*head)->line );
-    free( *head );
-    *head = p;
+    n = d->next;
+    free_linelist( d->line );
+    free( d );
   }
+  free( dict->hash );
+  memset( dict, 0, sizeof(Dict) );
 }
 
 
@@ -5169,7 +8042,7 @@ void list_define( PDefine d, WCHAR t )
 
 
 // List all macros or symbols, or just those specified.
-void list_defines( PDefine* head, DWORD pos )
+void list_defines( PDict dict, DWORD pos )
 {
   PDefine d;
   DWORD   end, cnt;
@@ -5178,11 +8051,11 @@ void list_defines( PDefine* head, DWORD pos )
   if (!redirect( pos ))
     return;
 
-  t = (head == &mac_head) ? 'm' : 's';
+  t = (dict == &macs) ? 'm' : 's';
 
   if (pos == line.len)
   {
-    for (d = *head; d; d = d->next)
+    for (d = dict->head; d; d = d->next)
       list_define( d, t );
   }
   else
@@ -5191,7 +8064,7 @@ void list_defines( PDefine* head, DWORD pos )
     {
       end = skip_nonblank( pos );
       cnt = end - pos;
-      d = find_define( head, pos, cnt );
+      d = find_define( dict, pos, cnt );
       if (d)
 	list_define( d, t );
       pos = skip_blank( end );
@@ -5213,6 +8086,7 @@ PLineList add_line( DWORD pos )
     memcpy( ll->line, line.txt + pos, WSZ(line.len - pos) );
     ll->len  = line.len - pos;
     ll->next = NULL;
+    ll->tmpl = NULL;
   }
 
   return ll;
@@ -5227,6 +8101,7 @@ void free_linelist( PLineList ll )
   while (ll)
   {
     nxt = ll->next;
+    free( ll->tmpl );
     free( ll );
     ll = nxt;
   }
@@ -5354,6 +8229,7 @@ BOOL make_line( DWORD len )
     max = len;
   }
   line.len = len;
+  ++line_gen;				// it's about to be given a new line
   return TRUE;
 }
 
@@ -5416,19 +8292,61 @@ DWORD skip_nondelim( DWORD pos )
 
 // Determine if a character is the beginning or end of a quoted string.
 // An odd number of backslashes before the quote will treat it literally.
+// Rather than look back over the backslashes each time, the quotes of the
+// line are flagged once, until the line changes.
 BOOL is_quote( int pos )
 {
   BOOL lit;
 
-  lit = FALSE;
-  if (pos < line.len && line.txt[pos] == '"')
+  if (pos < 0 || pos >= (int)line.len || line.txt[pos] != '"')
+    return FALSE;
+
+  if ((lex_gen == line_gen && lex_txt == line.txt && lex_len == line.len) ||
+      lex_line())
+    return (lex_map[pos] & LEX_QUOTE);
+
+  lit = TRUE;				// no memory for the flags
+  while (--pos >= 0 && line.txt[pos] == '\\')
+    lit ^= TRUE;
+
+  return lit;
+}
+
+
+// Flag the characters of the line in a single pass.  Returns FALSE if there's
+// no memory for the flags.
+BOOL lex_line( void )
+{
+  PBYTE map;
+  DWORD pos, bs;
+
+  if (line.len > lex_max)
   {
-    lit = TRUE;
-    while (--pos >= 0 && line.txt[pos] == '\\')
-      lit ^= TRUE;
+    map = realloc( lex_map, line.len );
+    if (!map)
+      return FALSE;
+    lex_map = map;
+    lex_max = line.len;
   }
 
-  return lit;
+  for (bs = pos = 0; pos < line.len; ++pos)
+  {
+    if (line.txt[pos] == '\\')
+    {
+      lex_map[pos] = 0;
+      ++bs;
+    }
+    else
+    {
+      lex_map[pos] = (line.txt[pos] == '"' && !(bs & 1)) ? LEX_QUOTE : 0;
+      bs = 0;
+    }
+  }
+
+  lex_txt = line.txt;
+  lex_len = line.len;
+  lex_gen = line_gen;
+  return TRUE;
 }
 
 
@@ -5437,68 +8355,74 @@ BOOL is_quote( int pos )
 // quotes are made surrounding and the quotes are excluded from the string.
 DWORD get_string( DWORD pos, LPDWORD cnt, BOOL keep )
 {
-  DWORD start;
-  BOOL	quote, oq;		// has the open quote been added?
-  DWORD cq = ~0;		// position of the close quote
+  DWORD start, n, bs, len;
+  BOOL	quote, oq, cq;		// open and close quotes found?
+  PWSTR str;
+  WCHAR ch;
 
-  found_quote = quote = oq = FALSE;
-  for (start = pos = skip_blank( pos ); pos < line.len; ++pos)
+  found_quote = quote = FALSE;
+  start = pos = skip_blank( pos );
+
+  // If there's no memory to rebuild the string, leave the quotes in it.
+  if (keep || !make_length( &esc_buf, &esc_max, line.len - start + 2 ))
   {
-    if (quote)
+    for (; pos < line.len; ++pos)
     {
       if (is_quote( pos ))
       {
-	quote = FALSE;
-	if (!keep)
-	{
-	  if (cq != ~0)
-	  {
-	    remove_chars( cq, 1 );
-	    --pos;
-	  }
-	  cq = pos;
-	}
+	found_quote = TRUE;
+	quote ^= TRUE;
       }
+      else if (!quote && isblank( line.txt[pos] ))
+	break;
     }
-    else if (is_quote( pos ))
+    *cnt = pos - start;
+    return start;
+  }
+
+  // Build the string without its quotes (leaving room for the open quote),
+  // then write it back once, surrounded by the first and last quotes.  The
+  // backslashes are counted as it's built, since removing a quote can put a
+  // backslash before another (the same as removing them one at a time).
+  for (bs = 0; bs < start && line.txt[start-bs-1] == '\\'; ++bs) ;
+  str = esc_buf + 1;
+  oq = cq = FALSE;
+  for (n = 0; pos < line.len; ++pos)
+  {
+    ch = line.txt[pos];
+    if (ch == '"' && !(bs & 1))
     {
-      found_quote = quote = TRUE;
-      if (!keep)
+      if (quote)
       {
-	if (oq)
-	  remove_chars( pos--, 1 );
-	else
-	{
-	  oq = TRUE;
-	  if (pos != start)
-	  {
-	    memmove( line.txt + start + 1, line.txt + start, WSZ(pos - start) );
-	    line.txt[start] = '"';
-	    set_display_marks( start, pos + 1 );
-	  }
-	}
+	quote = FALSE;
+	cq = TRUE;
+	bs = 0;
+      }
+      else
+      {
+	if (!oq && bs > n)	// the open quote goes before the string
+	  bs = n;
+	found_quote = quote = oq = TRUE;
       }
     }
-    else if (isblank( line.txt[pos] ))
+    else if (!quote && isblank( ch ))
       break;
-  }
-  if (!keep)
-  {
-    if (oq)
-      ++start;
-    if (cq != ~0)
+    else
     {
-      if (cq != --pos)
-      {
-	memcpy( line.txt + cq, line.txt + cq + 1, WSZ(pos - cq) );
-	line.txt[pos] = '"';
-	set_display_marks( cq, pos + 1 );
-      }
+      str[n++] = ch;
+      bs = (ch == '\\') ? bs + 1 : 0;
     }
   }
+  if (oq)
+    *--str = '"';
+  len = oq + n;
+  if (cq)
+    str[len++] = '"';
+  if (len != pos - start || memcmp( line.txt + start, str, WSZ(len) ))
+    replace_chars( start, pos - start, str, len );
 
-  *cnt = pos - start;
-  return start;
+  *cnt = n;
+  return start + oq;
 }
 
 
@@ -5507,28 +8431,36 @@ DWORD get_string( DWORD pos, LPDWORD cnt, BOOL keep )
 // handle those outside quotes).
 void un_escape( PCWSTR unq )
 {
-  DWORD pos;
+  DWORD pos, n, first, bs;
   BOOL	quote;
+  WCHAR ch;
 
-  if (!memchr( line.txt, ESCAPE, WSZ( line.len) ))
+  if (!memchr( line.txt, ESCAPE, WSZ( line.len) ) ||
+      !make_length( &esc_buf, &esc_max, line.len ))
     return;
 
+  // Copy the line without the escapes and write it back once, from the first
+  // escape removed.  The backslashes are counted as it's copied, since
+  // removing an escape can put a backslash before a quote.
   quote = FALSE;
-  for (pos = 0; pos < line.len; ++pos)
-  {
-    if (quote)
+  first = ~0;
+  for (pos = n = bs = 0; pos < line.len; ++pos)
+  {
+    ch = line.txt[pos];
+    if (ch == '"' && !(bs & 1))
+      quote ^= TRUE;
+    else if (ch == ESCAPE && pos+1 < line.len &&
+	     (quote ? unq && wcschr( unq, line.txt[pos+1] ) : !unq))
     {
-      if (is_quote( pos ))
-	quote = FALSE;
-      else if (unq && line.txt[pos] == ESCAPE && pos+1 < line.len &&
-	       wcschr( unq, line.txt[pos+1] ))
-	remove_chars( pos, 1 );
+      if (first == ~0)
+	first = n;
+      ch = line.txt[++pos];
     }
-    else if (is_quote( pos ))
-      quote = TRUE;
-    else if (!unq && line.txt[pos] == ESCAPE && pos+1 < line.len)
-      remove_chars( pos, 1 );
+    esc_buf[n++] = ch;
+    bs = (ch == '\\') ? bs + 1 : 0;
   }
+  if (first != ~0)
+    replace_chars( first, line.len - first, esc_buf + first, n - first );
 }
 
 
@@ -5545,10 +8477,7 @@ BOOL match_ext( PCWSTR ext, DWORD cnt, PCWSTR extlist, DWORD extlen )
 				      extlist[end] != ';' &&
 				      extlist[end] != ':';) ;
     if (end - pos == cnt && _wcsnicmp( extlist + pos, ext, cnt ) == 0)
-    {
-      assoc_pos = pos;
       return TRUE;
-    }
     if (end == extlen)
       break;
     if (extlist[end] != '.')
@@ -5560,41 +8489,141 @@ BOOL match_ext( PCWSTR ext, DWORD cnt, PCWSTR extlist, DWORD extlen )
 
 
 // Get an environment variable; if it doesn't exist use def, if it exists.
-// The variable is stored in the global envvar buffer; its length is returned.
+// The variable is stored in the global envvar buffer (with a terminating NUL);
+// its length is returned.  The value comes from the snapshot, if there is one.
 DWORD get_env_var( PCWSTR var, PCWSTR def )
 {
-  DWORD varlen;
-  PWSTR v;
-  BOOL	exist;
+  PEnvEnt e;
+  PCWSTR  val;
+  DWORD   varlen;
+  PWSTR   v;
 
-  varlen = GetEnvironmentVariable( var, envvar.txt, envvar.len );
-  if (varlen == 0 && def && *def)
+  if (!env_hash)
   {
-    exist  = FALSE;
+    varlen = GetEnvironmentVariable( var, envvar.txt, envvar.len );
+    if (varlen > envvar.len)
+    {
+      v = realloc( envvar.txt, WSZ(varlen) );
+      if (!v)
+	return 0;
+      envvar.txt = v;
+      envvar.len = varlen;
+      varlen = GetEnvironmentVariable( var, envvar.txt, envvar.len );
+    }
+    if (varlen || !def || !*def)
+      return varlen;
+    val = def;
     varlen = wcslen( def );
-    if (varlen <= envvar.len)
-      memcpy( envvar.txt, def, WSZ(varlen) );
   }
   else
-    exist = TRUE;
+  {
+    e = find_env( var, wcslen( var ) );
+    if (e && e->vallen)
+    {
+      val = e->val;
+      varlen = e->vallen;
+    }
+    else if (def && *def)
+    {
+      val = def;
+      varlen = wcslen( def );
+    }
+    else
+      return 0;
+  }
 
-  if (varlen && varlen > envvar.len)
+  if (varlen + 1 > envvar.len)
   {
-    v = realloc( envvar.txt, WSZ(varlen) );
+    v = realloc( envvar.txt, WSZ(varlen + 1) );
     if (!v)
       return 0;
     envvar.txt = v;
-    envvar.len = varlen;
-    if (exist)
-      varlen = GetEnvironmentVariable( var, envvar.txt, envvar.len );
-    else
-      memcpy( envvar.txt, def, WSZ(varlen) );
+    envvar.len = varlen + 1;
   }
+  memcpy( envvar.txt, val, WSZ(varlen) );
+  envvar.txt[varlen] = '\0';
 
   return varlen;
 }
 
 
+// Take a snapshot of the environment and index its variables.  CMD.EXE only
+// changes its environment while it runs a command, so this is done once per
+// line; if the environment is the same as last time, the index is kept.
+void snap_env( void )
+{
+  PWSTR   blk, p;
+  PEnvEnt e;
+  DWORD   size, cnt, buckets, j;
+
+  blk = GetEnvironmentStringsW();
+  if (!blk)
+    return;
+  for (cnt = 0, p = blk; *p; p += wcslen( p ) + 1)
+    ++cnt;
+  size = p - blk + 1;
+  if (env_hash && size == env_size && memcmp( blk, env_block, WSZ(size) ) == 0)
+  {
+    FreeEnvironmentStringsW( blk );
+    return;
+  }
+
+  if (env_block)
+    FreeEnvironmentStringsW( env_block );
+  free( env_ent );
+  free( env_hash );
+  env_block = blk;
+  env_size  = size;
+  for (buckets = 64; buckets < cnt * 2; buckets *= 2) ;
+  env_ent  = malloc( (cnt + 1) * sizeof(EnvEnt) );
+  env_hash = calloc( buckets, sizeof(PEnvEnt) );
+  if (!env_ent || !env_hash)
+  {
+    free( env_ent );
+    free( env_hash );
+    env_ent  = NULL;
+    env_hash = NULL;			// get_env_var will ask Windows
+    return;
+  }
+  env_buckets = buckets;
+
+  for (e = env_ent, p = blk; *p; p += wcslen( p ) + 1, ++e)
+  {
+    // Names can start with '=' (the current directory of each drive).
+    for (j = 1; p[j] && p[j] != '='; ++j) ;
+    e->name    = p;
+    e->namelen = j;
+    e->val     = (p[j]) ? p + j + 1 : p + j;
+    e->vallen  = wcslen( e->val );
+    e->hash    = hash_name( p, j );
+    e->chain   = env_hash[e->hash & (buckets - 1)];
+    env_hash[e->hash & (buckets - 1)] = e;
+  }
+}
+
+
+// Find variable var (of cnt characters) in the snapshot.  Returns NULL if it's
+// not there (or there's no snapshot).
+PEnvEnt find_env( PCWSTR var, DWORD cnt )
+{
+  PEnvEnt e;
+  DWORD   h;
+
+  if (!env_hash)
+    return NULL;
+
+  h = hash_name( var, cnt );
+  for (e = env_hash[h & (env_buckets - 1)]; e; e = e->chain)
+  {
+    if (e->hash == h && e->namelen == cnt &&
+	_wcsnicmp( e->name, var, cnt ) == 0)
+      break;
+  }
+
+  return e;
+}
+
+
 // Show an internal command error.  If reading a file, remove the prompt and
 // show the line number.
 void show_error( PCWSTR err, DWORD pos, DWORD len )
@@ -5690,6 +8719,7 @@ WINAPI MyReadConsoleW( HANDLE hConsoleInput, LPVOID lpBuffer,
   {
     local.enabled ^= TRUE;		// only disable this instance
     option.disable_CMDread = 0;
+    publish_status();
   }
 
   hConIn  = hConsoleInput;
@@ -5832,13 +8862,19 @@ WINAPI MyReadConsoleW( HANDLE hConsoleInput, LPVOID lpBuffer,
 	p_attr_len = 0;
     }
 
+    snap_env();
+
     if (*cfgname)
     {
+      time_phase( -1 );
       read_cmdfile( cfgname );
       *cfgname = 0;
+      time_phase( TIME_CONFIG );
     }
 
     check_history();
+    if (option.timing && !local.timing.ready)
+      time_ready();
 
     line.txt = lpBuffer;
     max = nNumberOfCharsToRead - 2;	// leave room for CRLF
@@ -5849,24 +8885,12 @@ WINAPI MyReadConsoleW( HANDLE hConsoleInput, LPVOID lpBuffer,
     {
       do
       {
+	LONGLONG started;
 	get_next_line();
+	started = lat_now();
 	multi_cmd();
-	do
-	{
-	  if (check_break > 1)
-	    break;
-	  if (line.len != 0 && *line.txt == '@')
-	  {
-	    remove_chars( 0, 1 );
-	    dosify();
-	  }
-	  if (line.len != 0 && *line.txt == option.ignore_char)
-	  {
-	    remove_chars( 0, 1 );
-	    break;
-	  }
-	  expand_braces();
-	} while (associate() || expand_symbol() || expand_macro());
+	expand_line();
+	lat_add( lat_extra + LAT_EXPAND, started );
       } while (internal_cmd());
       expand_vars( FALSE );
     }
@@ -5875,6 +8899,12 @@ WINAPI MyReadConsoleW( HANDLE hConsoleInput, LPVOID lpBuffer,
     line.txt[line.len++] = '\n';
     *lpNumberOfCharsRead = line.len;
 
+    // CMDread will be run from the command, so the status should be current.
+    ++metrics.lines;
+    publish_status();
+    if (primary && mtr_event == NULL)
+      watch_metrics();
+
     CloseHandle( hConWid );
     if (dbcs)
       CloseHandle( hConWid1 );
@@ -5901,7 +8931,307 @@ BOOL ctrl_break( DWORD type )
 }
 
 
-// Assume the output prior to input is the prompt.
+// Add the time since the previous call to phase (or just start timing, if
+// phase is -1).
+void time_phase( int phase )
+{
+  LONGLONG now;
+
+  if (!option.timing)
+    return;
+
+  QueryPerformanceCounter( (PLARGE_INTEGER)&now );
+  if (phase >= 0)
+    local.timing.phase[phase] += now - time_last;
+  time_last = now;
+}
+
+
+// The first line is about to be edited: add CMDread's part of the start-up
+// and how long it's been since CMD.EXE started.
+void time_ready( void )
+{
+  FILETIME created, now, dummy;
+  int	   j;
+
+  QueryPerformanceFrequency( (PLARGE_INTEGER)&local.timing.freq );
+  if (start_timing.pid == GetCurrentProcessId())
+  {
+    for (j = 0; j < TIME_HOOK; ++j)
+      local.timing.phase[j] = start_timing.phase[j];
+    start_timing.pid = 0;
+  }
+  // Add one, so it's never zero (not ready).
+  GetSystemTimeAsFileTime( &now );
+  if (!GetProcessTimes( GetCurrentProcess(), &created, &dummy, &dummy, &dummy ))
+    created = now;
+  local.timing.ready = (((LONGLONG)now.dwHighDateTime << 32)
+					      | now.dwLowDateTime)
+		     - (((LONGLONG)created.dwHighDateTime << 32)
+					       | created.dwLowDateTime) + 1;
+}
+
+
+// Find a free entry in the instance registry.  If they're all in use, take
+// over one from a process that was terminated (so never released it).  If
+// there's still nothing, CMDread falls back to reading our exports.
+void claim_instance( void )
+{
+  FILETIME dummy;
+  LONG	   me, pid;
+  int	   j, pass;
+
+  me = GetCurrentProcessId();
+  for (pass = 0; pass < 2 && instance == NULL; ++pass)
+  {
+    for (j = 0; j < INSTANCES; ++j)
+    {
+      pid = instances[j].pid;
+      if (pid != 0 && (pass == 0 || !stale_instance( instances + j )))
+	continue;
+      if (InterlockedCompareExchange( &instances[j].pid, me, pid ) == pid)
+      {
+	instance = instances + j;
+	break;
+      }
+    }
+  }
+
+  if (instance != NULL)
+  {
+    // A terminated process may have left its status behind (perhaps even
+    // half-written, so make sure the sequence starts even).
+    if (instance->seq & 1)
+      InterlockedIncrement( &instance->seq );
+    InterlockedIncrement( &instance->seq );
+    instance->status.version = 0;
+    GetProcessTimes( GetCurrentProcess(), &instance->created,
+		     &dummy, &dummy, &dummy );
+    InterlockedIncrement( &instance->seq );
+    publish_status();
+  }
+}
+
+
+// Determine if an entry belongs to a process that no longer exists (or to an
+// earlier process with the same id).
+BOOL stale_instance( PInstance inst )
+{
+  FILETIME created, dummy;
+  HANDLE   ph;
+  DWORD    code;
+  BOOL	   gone;
+
+  ph = OpenProcess( PROCESS_QUERY_INFORMATION, FALSE, inst->pid );
+  if (ph == NULL)
+    return (GetLastError() == ERROR_INVALID_PARAMETER);
+
+  gone = (!GetProcessTimes( ph, &created, &dummy, &dummy, &dummy ) ||
+	  CompareFileTime( &created, &inst->created ) != 0 ||
+	  (GetExitCodeProcess( ph, &code ) && code != STILL_ACTIVE));
+  CloseHandle( ph );
+
+  return gone;
+}
+
+
+void publish_status( void )
+{
+  if (instance != NULL)
+  {
+    count_metrics();
+    InterlockedIncrement( &instance->seq );	// odd, being written
+    instance->status  = local;
+    instance->metrics = metrics;
+    InterlockedIncrement( &instance->seq );	// even, done
+  }
+}
+
+
+// Copy entry j of the registry to inst, copying it again if its owner was
+// writing it at the time (the sequence was odd, or changed during the copy).
+// Returns FALSE if the entry is free, or a consistent copy couldn't be made.
+BOOL copy_instance( int j, PInstance inst )
+{
+  LONG seq;
+  int  tries;
+
+  for (tries = 0; tries < COPY_TRIES; ++tries)
+  {
+    // The exchange never changes it, but is a barrier either side of the copy.
+    seq = InterlockedCompareExchange( &instances[j].seq, 0, 0 );
+    if (!(seq & 1))
+    {
+      *inst = instances[j];
+      if (InterlockedCompareExchange( &instances[j].seq, 0, 0 ) == seq)
+	return (inst->pid != 0 && inst->status.version != 0);
+    }
+    Sleep( 0 );
+  }
+  return FALSE;
+}
+
+
+// Update the counters that aren't counted as they happen.
+void count_metrics( void )
+{
+  PMacro m;
+
+  metrics.hist_lines = histsize;
+
+  for (metrics.macros = macs.count, m = macro_head; m; m = m->next)
+    ++metrics.macros;
+  metrics.symbols = syms.count;
+  metrics.assocs  = assocs.count;
+
+  metrics.completions = lat_extra[LAT_FIND].count;
+  if (lat_freq != 0)
+    metrics.completion_us = lat_extra[LAT_FIND].total * 1000000 / lat_freq;
+}
+
+
+// Write the counters of every instance to file name, followed by their
+// totals.  Each line is "cmdread_NAME{pid="PID"} VALUE", or without the braces
+// for the total.  The file is written under another name and then renamed, so
+// it's never seen half-written.  Returns FALSE if it couldn't be written.
+BOOL write_metrics( PCWSTR name )
+{
+  WCHAR    tmp[MAX_PATH+12];
+  FILE*    out;
+  LONGLONG total[METRICS];
+  const LONGLONG* cnt;
+  Instance inst;
+  int	   i, j, live;
+  BOOL	   ok;
+
+  _snwprintf( tmp, lenof(tmp), L"%s.%lu", name, GetCurrentProcessId() );
+  out = _wfopen( tmp, L"w" );
+  if (out == NULL)
+    return FALSE;
+
+  fprintf( out, "# CMDread %s metrics\n", PVERSA );
+  memset( total, 0, sizeof(total) );
+  live = 0;
+  for (i = 0; i < INSTANCES; ++i)
+  {
+    if (!copy_instance( i, &inst ))
+      continue;
+    ++live;
+    cnt = (const LONGLONG*)&inst.metrics;
+    for (j = 0; j < METRICS; ++j)
+    {
+      fprintf( out, "cmdread_%s{pid=\"%ld\"} %I64d\n",
+	       metric_str[j], inst.pid, cnt[j] );
+      total[j] += cnt[j];
+    }
+  }
+  fprintf( out, "cmdread_instances %d\n", live );
+  for (j = 0; j < METRICS; ++j)
+    fprintf( out, "cmdread_%s %I64d\n", metric_str[j], total[j] );
+
+  ok = !ferror( out );
+  if (fclose( out ) != 0 || !ok ||
+      !MoveFileEx( tmp, name, MOVEFILE_REPLACE_EXISTING ))
+  {
+    DeleteFile( tmp );
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+// The primary instance writes the metrics file every mtr_secs seconds (as set
+// by CMDread -m).
+void set_metrics_timer( void )
+{
+  if (mtr_timer != NULL)
+  {
+    DeleteTimerQueueTimer( NULL, mtr_timer, NULL );
+    mtr_timer = NULL;
+  }
+  mtr_timer_secs = mtr_secs;
+  if (mtr_timer_secs != 0)
+    CreateTimerQueueTimer( &mtr_timer, NULL, metrics_timer, NULL,
+			   mtr_timer_secs * 1000, mtr_timer_secs * 1000,
+			   WT_EXECUTEDEFAULT );
+}
+
+
+VOID CALLBACK metrics_timer( PVOID param, BOOLEAN fired )
+{
+  if (*mtrname)
+    write_metrics( mtrname );
+}
+
+
+// Start the timer the previous primary may have had, then have CMDread -m
+// change it straight away, rather than waiting for the next line.  From now
+// on the timer is only changed by metrics_changed.
+void watch_metrics( void )
+{
+  mtr_event = CreateEvent( NULL, FALSE, FALSE, METRICS_EVENT );
+  if (mtr_event == NULL)
+    return;
+  if (mtr_secs != 0)
+    set_metrics_timer();
+  if (!RegisterWaitForSingleObject( &mtr_wait, mtr_event, metrics_changed,
+				    NULL, INFINITE, WT_EXECUTEDEFAULT ))
+    mtr_wait = NULL;
+}
+
+
+VOID CALLBACK metrics_changed( PVOID param, BOOLEAN timed_out )
+{
+  if (mtr_secs != mtr_timer_secs)
+    set_metrics_timer();
+}
+
+
+// Free our entry; clear the version first, so it's not read half-released.
+void release_instance( void )
+{
+  if (instance != NULL)
+  {
+    InterlockedIncrement( &instance->seq );
+    instance->status.version = 0;
+    InterlockedIncrement( &instance->seq );
+    InterlockedExchange( &instance->pid, 0 );
+    instance = NULL;
+  }
+}
+
+
+LONGLONG lat_now( void )
+{
+  LONGLONG now;
+
+  QueryPerformanceCounter( (PLARGE_INTEGER)&now );
+  return now;
+}
+
+
+// Add the time since started to lat.
+void lat_add( Latency* lat, LONGLONG started )
+{
+  LONGLONG us;
+  int	   j;
+
+  if (lat_freq == 0)
+    QueryPerformanceFrequency( (PLARGE_INTEGER)&lat_freq );
+
+  started = lat_now() - started;
+  lat->total += started;
+  ++lat->count;
+  us = started * 1000000 / lat_freq;
+  for (j = 0; j < LAT_BUCKETS - 1 && us >= 1 << j; ++j) ;
+  ++lat->bucket[j];
+}
+
+
+// Assume the output prior to input is the prompt.  This is on the path of all
+// CMD.EXE's output, so apart from the Hidden command and output ending with a
+// space, it only remembers the buffer; where the previous command finished is
+// found when it's needed.
 BOOL
 WINAPI MyWriteConsoleW( HANDLE hConsoleOutput, CONST VOID* lpBuffer,
 			DWORD nNumberOfCharsToWrite,
@@ -5909,12 +9239,21 @@ WINAPI MyWriteConsoleW( HANDLE hConsoleOutput, CONST VOID* lpBuffer,
 {
   if (nNumberOfCharsToWrite == 2 && memcmp( lpBuffer, L"\r\n", 4 ) == 0)
   {
-    // Remember where the previous command finished, so we can restore it.
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo( hConsoleOutput, &csbi );
-    lastc = csbi.dwCursorPosition;
     erase_prompt = 1;
 
+    // Trailing spaces can't be told from the padding, so ask where they end.
+    lastc_known = FALSE;
+    if (end_space && !hidden_cmd)
+    {
+      CONSOLE_SCREEN_BUFFER_INFO csbi;
+      if (GetConsoleScreenBufferInfo( hConsoleOutput, &csbi ))
+      {
+	lastc.X = csbi.dwCursorPosition.X;
+	lastc_known = TRUE;
+      }
+    }
+    end_space = FALSE;
+
     if (hidden_cmd)
     {
       // For a command with no output, we want to prevent this being written,
@@ -5922,7 +9261,9 @@ WINAPI MyWriteConsoleW( HANDLE hConsoleOutput, CONST VOID* lpBuffer,
       // still want to separate the output from the new prompt.  If the cursor
       // is not at the start of the line, it's safe to assume output; otherwise
       // see if the previous line is blank (no real need to add a second blank).
-      if (lastc.X != 0)
+      CONSOLE_SCREEN_BUFFER_INFO csbi;
+      GetConsoleScreenBufferInfo( hConsoleOutput, &csbi );
+      if (csbi.dwCursorPosition.X != 0)
 	hidden_cmd = FALSE;
       else
       {
@@ -5954,6 +9295,8 @@ WINAPI MyWriteConsoleW( HANDLE hConsoleOutput, CONST VOID* lpBuffer,
     prompt.txt = (PWSTR)lpBuffer;
     prompt.len = nNumberOfCharsToWrite;
     erase_prompt = 2;
+    if (nNumberOfCharsToWrite != 0)
+      end_space = (prompt.txt[nNumberOfCharsToWrite - 1] == ' ');
   }
   hidden_cmd = FALSE;
 
@@ -6123,14 +9466,16 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
       if (lpReserved)			// static initialisation
 	break;
 
+      time_phase( -1 );
       if (HookAPIOneMod( GetModuleHandle( NULL ), Hooks ))
       {
 	HookAPIOneMod( hInstance, Hooks );
+	time_phase( TIME_HOOK );
 
 	if (primary_id == 0 || cmd_history)
 	{
 	  check_history();
-	  read_history();
+	  start_loader( FALSE );
 	  if (primary_id == 0)
 	  {
 	    primary = TRUE;
@@ -6140,17 +9485,37 @@ BOOL WINAPI DllMain( HINSTANCE hInstance, DWORD dwReason, LPVOID lpReserved )
 	else
 	{
 	  *hstname = '\0';
-	  copy_parent_history();
+	  start_loader( TRUE );
 	}
+	time_phase( TIME_HISTORY );
+	claim_instance();
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE)ctrl_break, TRUE );
       }
     break;
 
     case DLL_PROCESS_DETACH:
+      // Don't write a history that was only partly read.
+      if (loader != NULL && !loader_done)
+	save_history = FALSE;
       if (save_history)
+      {
+	if (loader != NULL)
+	{
+	  CloseHandle( loader );
+	  loader = NULL;
+	}
+	merge_history();
 	write_history();
+      }
       if (primary)
 	primary_id = 0;
+      if (mtr_wait != NULL)
+	UnregisterWait( mtr_wait );
+      if (mtr_event != NULL)
+	CloseHandle( mtr_event );
+      if (mtr_timer != NULL)
+	DeleteTimerQueueTimer( NULL, mtr_timer, NULL );
+      release_instance();
     break;
   }
 
@@ -4,7 +4,7 @@
   Jason Hood, 30 July, 2011.
 */
 
-#define PVERS	L"2.12"         // string
-#define PVERSA	 "2.12"         // ANSI string (windres 2.16.91 didn't like L)
-#define PVERX	0x212		// hex
-#define PVERB	2,1,2,0 	// binary (resource)
+#define PVERS	L"2.13"         // string
+#define PVERSA	 "2.13"         // ANSI string (windres 2.16.91 didn't like L)
+#define PVERX	0x213		// hex
+#define PVERB	2,1,3,0 	// binary (resource)